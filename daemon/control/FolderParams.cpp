@@ -40,6 +40,7 @@ FolderParams::FolderParams(QVariantMap fconfig) {
 	// Optional
 	system_path = fconfig["system_path"].isValid() ? fconfig["system_path"].toString() : path + "/.librevault";
 	index_event_timeout = std::chrono::milliseconds(fconfig["index_event_timeout"].toInt());
+	index_threads = fconfig["index_threads"].toUInt();
 	preserve_unix_attrib = fconfig["preserve_unix_attrib"].toBool();
 	preserve_windows_attrib = fconfig["preserve_windows_attrib"].toBool();
 	preserve_symlinks = fconfig["preserve_symlinks"].toBool();
@@ -65,6 +66,9 @@ FolderParams::FolderParams(QVariantMap fconfig) {
 	archive_trash_ttl = fconfig["archive_trash_ttl"].toInt();
 	archive_timestamp_count = fconfig["archive_timestamp_count"].toInt();
 	mainline_dht_enabled = fconfig["mainline_dht_enabled"].toBool();
+
+	enc_storage_type = fconfig["enc_storage_type"].toString() == "packed" ? EncStorageType::PACKED : EncStorageType::FILES;
+	progressive_assembly = fconfig["progressive_assembly"].toBool();
 }
 
 } /* namespace librevault */
@@ -44,6 +44,10 @@ struct FolderParams {
 		TIMESTAMP_ARCHIVE,
 		BLOCK_ARCHIVE
 	};
+	enum class EncStorageType : unsigned {
+		FILES = 0,
+		PACKED
+	};
 
 	FolderParams(QVariantMap fconfig);
 
@@ -52,6 +56,7 @@ struct FolderParams {
 	QString path;
 	QString system_path;
 	std::chrono::milliseconds index_event_timeout;
+	unsigned index_threads;
 	bool preserve_unix_attrib;
 	bool preserve_windows_attrib;
 	bool preserve_symlinks;
@@ -64,6 +69,8 @@ struct FolderParams {
 	unsigned archive_trash_ttl;
 	unsigned archive_timestamp_count;
 	bool mainline_dht_enabled;
+	EncStorageType enc_storage_type;
+	bool progressive_assembly;
 };
 
 } /* namespace librevault */
@@ -86,7 +86,15 @@ FolderGroup::FolderGroup(FolderParams params, StateCollector* state_collector, Q
 		downloader_->notifyLocalChunk(ct_hash);
 		uploader_->broadcast_chunk(remotes(), ct_hash);
 	});
-	connect(downloader_, &Downloader::chunkDownloaded, chunk_storage_, &ChunkStorage::put_chunk);
+	connect(chunk_storage_, &ChunkStorage::metaAssembled, this, &FolderGroup::handle_indexed_meta);	// Chunks, copied from local files, are not downloaded anymore
+	connect(downloader_, &Downloader::chunkDownloaded, chunk_storage_, [this](QByteArray ct_hash, QFile* chunk_f){
+		if(!chunk_storage_->put_chunk(ct_hash, chunk_f))
+			downloader_->notifyChunkNotStored(ct_hash);
+	});
+	connect(downloader_, &Downloader::chunkDownloadedInMemory, chunk_storage_, [this](QByteArray ct_hash, QByteArray chunk_ct){
+		if(!chunk_storage_->put_chunk(ct_hash, chunk_ct))
+			downloader_->notifyChunkNotStored(ct_hash);
+	});
 	connect(state_pusher_, &QTimer::timeout, this, &FolderGroup::push_state);
 
 	// Set up state pusher
@@ -95,14 +103,18 @@ FolderGroup::FolderGroup(FolderParams params, StateCollector* state_collector, Q
 
 	// Go through index
 	QTimer::singleShot(0, this, [=]{
-		for(auto& smeta : meta_storage_->getMeta())
+		meta_storage_->forEachMeta([=](const SignedMeta& smeta){
 			handle_indexed_meta(smeta);
+		});
 	});
 }
 
 FolderGroup::~FolderGroup() {
 	state_pusher_->stop();
 
+	// Assembler threads use MetaStorage, so they are stopped before it is destroyed
+	delete chunk_storage_;
+
 	state_collector_->folder_state_purge(conv_bytearray(params_.secret.get_Hash()));
 	LOGFUNC();
 }
@@ -141,6 +153,9 @@ void FolderGroup::handle_handshake(RemoteFolder* origin) {
 	connect(origin, &RemoteFolder::rcvdBlockRequest, uploader_, [=](const blob& ct_hash, uint32_t offset, uint32_t size){
 		uploader_->handle_block_request(origin, ct_hash, offset, size);
 	});
+	connect(origin, &RemoteFolder::rcvdBlockCancel, uploader_, [=](const blob& ct_hash, uint32_t offset, uint32_t size){
+		uploader_->handle_block_cancel(origin, ct_hash, offset, size);
+	});
 	connect(origin, &RemoteFolder::rcvdBlockReply, downloader_, [=](const blob& ct_hash, uint32_t offset, const blob& block){
 		downloader_->putBlock(ct_hash, offset, block, origin);
 	});
@@ -174,6 +189,7 @@ void FolderGroup::detach(P2PFolder* remote) {
 
 	emit detached(remote);
 	downloader_->untrackRemote(remote);
+	uploader_->untrack_remote(remote);
 
 	p2p_folders_digests_.remove(remote->digest());
 	p2p_folders_endpoints_.remove(remote->endpoint());
@@ -32,6 +32,7 @@
 #include <librevault/SignedMeta.h>
 #include <librevault/util/conv_bitfield.h>
 #include <QObject>
+#include <chrono>
 
 namespace librevault {
 
@@ -101,6 +102,7 @@ public:
 	bool peer_interested() const {return peer_interested_;}
 
 	virtual bool ready() const = 0;
+	virtual std::chrono::milliseconds rtt() const = 0;	// Zero, if not measured yet
 
 protected:
 	bool am_choking_ = true;
@@ -28,7 +28,13 @@
  */
 #include "AssemblerQueue.h"
 #include "AssemblerWorker.h"
+#include "ChunkStorage.h"
+#include "StagingWriter.h"
+#include "control/FolderParams.h"
 #include "folder/meta/MetaStorage.h"
+#include "util/conv_fspath.h"
+#include <boost/filesystem.hpp>
+#include <QDir>
 #include <QLoggingCategory>
 
 Q_DECLARE_LOGGING_CATEGORY(log_assembler)
@@ -49,6 +55,19 @@ AssemblerQueue::AssemblerQueue(const FolderParams& params,
 
 	threadpool_ = new QThreadPool(this);
 
+	// Staging files from previous run are not trusted, we don't know which chunks were written completely
+	foreach(const QString& staging_name, QDir(params_.system_path).entryList({"staging-*"}, QDir::Files))
+		QFile::remove(params_.system_path + "/" + staging_name);
+
+	connect(meta_storage_, &MetaStorage::metaAdded, this, &AssemblerQueue::metaAdded);
+
+	// Missing counters of all incomplete Metas are computed once. After that, they are updated by chunkAdded() and metaAdded()
+	QTimer::singleShot(0, this, [this]{
+		meta_storage_->forEachIncompleteMeta([this](const SignedMeta& smeta){
+			addAssemble(smeta);
+		});
+	});
+
 	assemble_timer_ = new QTimer(this);
 	assemble_timer_->setInterval(30*1000);
 	connect(assemble_timer_, &QTimer::timeout, this, &AssemblerQueue::periodic_assemble_operation);
@@ -58,21 +77,232 @@ AssemblerQueue::AssemblerQueue(const FolderParams& params,
 AssemblerQueue::~AssemblerQueue() {
 	qCDebug(log_assembler) << "Stopping assembler queue";
 	emit aboutToStop();
+	meta_storage_->flush();	// Index batch holds the write lock, workers could wait for it
 	threadpool_->waitForDone();
 	qCDebug(log_assembler) << "Assembler queue stopped";
 }
 
 void AssemblerQueue::addAssemble(SignedMeta smeta) {
-	AssemblerWorker* worker = new AssemblerWorker(smeta, params_, meta_storage_, chunk_storage_, path_normalizer_, archive_);
+	QByteArray path_id = conv_bytearray(smeta.meta().path_id());
+
+	auto running_it = running_.find(path_id);
+	if(running_it != running_.end()) {
+		*running_it = smeta;    // It will be tracked again after the running worker finishes
+		return;
+	}
+
+	track(smeta);
+}
+
+void AssemblerQueue::chunkAdded(QByteArray ct_hash) {
+	chunkAvailable(ct_hash, true);
+}
+
+void AssemblerQueue::metaAdded(SignedMeta smeta) {
+	if(smeta.meta().meta_type() != Meta::FILE || waiting_plaintext_.isEmpty()) return;
+
+	for(auto& chunk : smeta.meta().chunks()) {
+		auto plaintext_it = waiting_plaintext_.find(conv_bytearray(chunk.pt_hmac));
+		if(plaintext_it == waiting_plaintext_.end()) continue;
+		if(chunk_storage_->find_local_chunk(chunk.pt_hmac).isEmpty()) continue;	// Not assembled, or changed since
+
+		for(auto& ct_hash : QSet<QByteArray>(*plaintext_it))
+			chunkAvailable(ct_hash, false);
+	}
+}
+
+void AssemblerQueue::chunkAvailable(const QByteArray& ct_hash, bool stored) {
+	QSet<QByteArray> path_ids = waiting_.value(ct_hash);
+	forgetWaiting(ct_hash);
+	for(auto& path_id : path_ids) {
+		auto pending_it = pending_.find(path_id);
+		if(pending_it == pending_.end()) continue;
+
+		pending_it->missing_chunks.remove(ct_hash);
+		if(pending_it->progressive && stored)
+			pending_it->staging_queue.insert(ct_hash);  // Chunks, reusable from local files, are copied by AssemblerWorker
+
+		if(pending_it->missing_chunks.isEmpty())
+			startAssemble(path_id);
+		else
+			scheduleStaging(path_id);
+	}
+}
+
+void AssemblerQueue::track(SignedMeta smeta, bool local_copies) {
+	QByteArray path_id = conv_bytearray(smeta.meta().path_id());
+
+	PendingMeta pending;
+	pending.smeta = smeta;
+
+	// Coalescing with the previously tracked Meta. Its counter is recomputed, but staging of the same revision is kept
+	auto pending_it = pending_.find(path_id);
+	if(pending_it != pending_.end() && pending_it->smeta.meta().revision() == smeta.meta().revision()) {
+		pending.staging_path = pending_it->staging_path;
+		pending.staged_chunks = pending_it->staged_chunks;
+		pending.staging_queue = pending_it->staging_queue;
+		pending.staging_running = pending_it->staging_running;
+		pending_it->staging_path.clear();   // Not to be removed by untrack()
+	}
+	untrack(path_id);
+	failed_.remove(path_id);
+
+	if(smeta.meta().meta_type() != Meta::FILE) {
+		startTask(smeta);
+		return;
+	}
+
+	// Computed once per Meta. After that, the counter is decremented by chunkAdded() and metaAdded()
+	pending.progressive = params_.progressive_assembly && smeta.meta().chunks().size() > 1;
+	auto bitfield = local_copies ? chunk_storage_->make_reusable_bitfield(smeta.meta()) : chunk_storage_->make_bitfield(smeta.meta());
+	for(size_t i = 0; i < bitfield.size(); i++) {
+		QByteArray ct_hash = conv_bytearray(smeta.meta().chunks().at(i).ct_hash);
+		if(!bitfield[i]) {
+			pending.missing_chunks.insert(ct_hash);
+			wait(ct_hash, conv_bytearray(smeta.meta().chunks().at(i).pt_hmac), path_id);
+		}else if(pending.progressive && !pending.staged_chunks.contains(ct_hash) && chunk_storage_->have_chunk(smeta.meta().chunks().at(i).ct_hash))
+			pending.staging_queue.insert(ct_hash);  // Chunks, reusable from local files, are copied by AssemblerWorker
+	}
+
+	pending_.insert(path_id, pending);
+
+	if(pending.missing_chunks.isEmpty())
+		startAssemble(path_id);
+	else
+		scheduleStaging(path_id);
+}
+
+void AssemblerQueue::untrack(const QByteArray& path_id) {
+	auto pending_it = pending_.find(path_id);
+	if(pending_it == pending_.end()) return;
+
+	for(auto& ct_hash : pending_it->missing_chunks) {
+		auto waiting_it = waiting_.find(ct_hash);
+		if(waiting_it == waiting_.end()) continue;
+		waiting_it->remove(path_id);
+		if(waiting_it->isEmpty())
+			forgetWaiting(ct_hash);
+	}
+	if(!pending_it->staging_path.isEmpty() && !pending_it->staging_running)
+		QFile::remove(pending_it->staging_path);  // If it is running, it is removed in finishStaging()
+	pending_.erase(pending_it);
+}
+
+void AssemblerQueue::wait(const QByteArray& ct_hash, const QByteArray& pt_hmac, const QByteArray& path_id) {
+	waiting_[ct_hash].insert(path_id);
+	if(!waiting_pt_hmac_.contains(ct_hash)) {
+		waiting_pt_hmac_.insert(ct_hash, pt_hmac);
+		waiting_plaintext_[pt_hmac].insert(ct_hash);
+	}
+}
+
+void AssemblerQueue::forgetWaiting(const QByteArray& ct_hash) {
+	waiting_.remove(ct_hash);
+
+	auto pt_hmac_it = waiting_pt_hmac_.find(ct_hash);
+	if(pt_hmac_it == waiting_pt_hmac_.end()) return;
+	auto plaintext_it = waiting_plaintext_.find(*pt_hmac_it);
+	if(plaintext_it != waiting_plaintext_.end()) {
+		plaintext_it->remove(ct_hash);
+		if(plaintext_it->isEmpty())
+			waiting_plaintext_.erase(plaintext_it);
+	}
+	waiting_pt_hmac_.erase(pt_hmac_it);
+}
+
+void AssemblerQueue::startAssemble(const QByteArray& path_id) {
+	auto pending_it = pending_.find(path_id);
+	if(pending_it == pending_.end() || pending_it->staging_running) return;    // Started by finishStaging()
+
+	PendingMeta pending = *pending_it;
+	pending_.erase(pending_it);
+
+	if(pending.staged_chunks.isEmpty() && !pending.staging_path.isEmpty()) {
+		QFile::remove(pending.staging_path);
+		pending.staging_path.clear();
+	}
+	startTask(pending.smeta, pending.staging_path, pending.staged_chunks);
+}
+
+void AssemblerQueue::startTask(SignedMeta smeta, QString staging_path, QSet<QByteArray> staged_chunks) {
+	QByteArray path_id = conv_bytearray(smeta.meta().path_id());
+	running_.insert(path_id, SignedMeta());
+
+	if(running_.size() == 1)
+		emit startedAssemble();
+
+	AssemblerWorker* worker = new AssemblerWorker(smeta, params_, meta_storage_, chunk_storage_, path_normalizer_, archive_, staging_path, staged_chunks);
 	worker->setAutoDelete(true);
+	connect(worker, &AssemblerWorker::finishedAssemble, this, &AssemblerQueue::finishTask, Qt::QueuedConnection);
 	threadpool_->start(worker);
 }
 
+void AssemblerQueue::finishTask(QByteArray path_id, bool assembled, bool chunks_missing) {
+	SignedMeta newer_smeta = running_.take(path_id);
+	if(newer_smeta)
+		track(newer_smeta);
+	else if(chunks_missing) {
+		// Local copy has failed. Waiting for the downloaded chunks
+		try {
+			track(meta_storage_->getMeta(conv_bytearray(path_id)), false);
+		}catch(MetaStorage::no_such_meta& e) {}
+	}else if(!assembled)
+		failed_.insert(path_id);
+	else {
+		try {
+			emit metaAssembled(meta_storage_->getMeta(conv_bytearray(path_id)));
+		}catch(MetaStorage::no_such_meta& e) {}
+	}
+
+	if(running_.isEmpty())
+		emit finishedAssemble();
+}
+
+void AssemblerQueue::scheduleStaging(const QByteArray& path_id) {
+	auto pending_it = pending_.find(path_id);
+	if(pending_it == pending_.end() || pending_it->staging_running || pending_it->staging_queue.isEmpty()) return;
+
+	// One writer per file at a time. Chunks, added while it runs, are written by the next one in a single batch
+	if(pending_it->staging_path.isEmpty())
+		pending_it->staging_path = params_.system_path + "/" + conv_fspath(boost::filesystem::unique_path("staging-%%%%-%%%%-%%%%-%%%%"));
+
+	StagingWriter* writer = new StagingWriter(pending_it->smeta, pending_it->staging_path, pending_it->staging_queue.toList(), chunk_storage_);
+	pending_it->staging_queue.clear();
+	pending_it->staging_running = true;
+
+	writer->setAutoDelete(true);
+	connect(writer, &StagingWriter::finishedStaging, this, &AssemblerQueue::finishStaging, Qt::QueuedConnection);
+	threadpool_->start(writer);
+}
+
+void AssemblerQueue::finishStaging(QByteArray path_id, QString staging_path, QList<QByteArray> staged_chunks) {
+	auto pending_it = pending_.find(path_id);
+	if(pending_it == pending_.end() || pending_it->staging_path != staging_path) {
+		QFile::remove(staging_path);    // Meta was replaced or assembled while staging
+		return;
+	}
+
+	pending_it->staging_running = false;
+	for(auto& ct_hash : staged_chunks)
+		pending_it->staged_chunks.insert(ct_hash);
+
+	if(pending_it->missing_chunks.isEmpty())
+		startAssemble(path_id);
+	else
+		scheduleStaging(path_id);
+}
+
 void AssemblerQueue::periodic_assemble_operation() {
 	qCDebug(log_assembler) << "Performing periodic assemble";
 
-	for(auto smeta : meta_storage_->getIncompleteMeta())
-		addAssemble(smeta);
+	// Only failed Metas are retried. Metas, waiting for chunks, are not recounted here
+	QSet<QByteArray> failed = failed_;
+	failed_.clear();
+	for(auto& path_id : failed) {
+		try {
+			addAssemble(meta_storage_->getMeta(conv_bytearray(path_id)));
+		}catch(MetaStorage::no_such_meta& e) {}
+	}
 }
 
 } /* namespace librevault */
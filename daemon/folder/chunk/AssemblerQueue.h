@@ -28,6 +28,8 @@
  */
 #pragma once
 #include <librevault/SignedMeta.h>
+#include <QHash>
+#include <QSet>
 #include <QTimer>
 #include <QThreadPool>
 
@@ -48,6 +50,7 @@ signals:
 
 	void startedAssemble();
 	void finishedAssemble();
+	void metaAssembled(SignedMeta smeta);	// All chunks of this Meta are local now, even if some of them were not downloaded
 
 public:
 	AssemblerQueue(const FolderParams& params,
@@ -59,6 +62,8 @@ public:
 
 public slots:
 	void addAssemble(SignedMeta smeta);
+	void chunkAdded(QByteArray ct_hash);	// Decrements missing counters of Metas, waiting for this chunk
+	void metaAdded(SignedMeta smeta);	// Rechecks missing chunks with the same plaintext, which can be copied from the new local file now
 
 private:
 	const FolderParams& params_;
@@ -69,6 +74,37 @@ private:
 
 	QThreadPool* threadpool_;
 
+	/* Scheduling. Every Meta is tracked at most once, keyed by path_id */
+	struct PendingMeta {
+		SignedMeta smeta;
+		QSet<QByteArray> missing_chunks;	// Missing counter is missing_chunks.size()
+
+		/* Progressive assembly. Available chunks are written into a preallocated staging file while the rest is downloaded */
+		bool progressive = false;
+		QString staging_path;
+		QSet<QByteArray> staged_chunks;	// Already written into staging file
+		QSet<QByteArray> staging_queue;	// Available, but not written yet
+		bool staging_running = false;
+	};
+	QHash<QByteArray, PendingMeta> pending_;	// Waiting for chunks
+	QHash<QByteArray, QSet<QByteArray>> waiting_;	// ct_hash -> path_ids of pending Metas, missing this chunk
+	QHash<QByteArray, QSet<QByteArray>> waiting_plaintext_;	// pt_hmac -> ct_hashes in waiting_
+	QHash<QByteArray, QByteArray> waiting_pt_hmac_;	// ct_hash -> pt_hmac, for cleanup of waiting_plaintext_
+	QSet<QByteArray> failed_;	// path_ids of Metas, which could not be assembled. Retried periodically
+	QHash<QByteArray, SignedMeta> running_;	// Being assembled now. Value is a newer Meta, added while assembling (or an empty one)
+
+	void track(SignedMeta smeta, bool local_copies = true);	// If local_copies is false, chunks, which can be copied from local files, are waited for, too
+	void untrack(const QByteArray& path_id);
+	void wait(const QByteArray& ct_hash, const QByteArray& pt_hmac, const QByteArray& path_id);
+	void forgetWaiting(const QByteArray& ct_hash);
+	void chunkAvailable(const QByteArray& ct_hash, bool stored);	// If not stored, it is copied from a local file by AssemblerWorker
+	void startAssemble(const QByteArray& path_id);	// Starts assembly of a pending Meta, after its staging is finished
+	void startTask(SignedMeta smeta, QString staging_path = QString(), QSet<QByteArray> staged_chunks = QSet<QByteArray>());
+	void finishTask(QByteArray path_id, bool assembled, bool chunks_missing);
+
+	void scheduleStaging(const QByteArray& path_id);
+	void finishStaging(QByteArray path_id, QString staging_path, QList<QByteArray> staged_chunks);
+
 	void periodic_assemble_operation();
 	QTimer* assemble_timer_;
 };
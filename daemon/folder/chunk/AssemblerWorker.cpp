@@ -36,13 +36,19 @@
 #include "folder/meta/MetaStorage.h"
 #include "util/conv_fspath.h"
 #include "util/readable.h"
+#include "util/sync_file.h"
+#include <librevault/crypto/HMAC-SHA3.h>
 #include <boost/filesystem.hpp>
 #include <QDir>
+#include <QFileInfo>
 #include <QLoggingCategory>
-#include <QSaveFile>
 #ifdef Q_OS_UNIX
 #   include <sys/stat.h>
 #endif
+#ifdef Q_OS_LINUX
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#endif
 #ifdef Q_OS_WIN
 #   include <windows.h>
 #endif
@@ -55,38 +61,29 @@ AssemblerWorker::AssemblerWorker(SignedMeta smeta, const FolderParams& params,
 	                             MetaStorage* meta_storage,
 	                             ChunkStorage* chunk_storage,
 	                             PathNormalizer* path_normalizer,
-	                             Archive* archive) :
+	                             Archive* archive,
+	                             QString staging_path,
+	                             QSet<QByteArray> staged_chunks) :
 	params_(params),
 	meta_storage_(meta_storage),
 	chunk_storage_(chunk_storage),
 	path_normalizer_(path_normalizer),
 	archive_(archive),
 	smeta_(smeta),
-	meta_(smeta.meta()) {}
+	meta_(smeta.meta()),
+	staging_path_(staging_path),
+	staged_chunks_(staged_chunks) {}
 
 AssemblerWorker::~AssemblerWorker() {}
 
-QByteArray AssemblerWorker::get_chunk_pt(const blob& ct_hash) const {
-	blob chunk = conv_bytearray(chunk_storage_->get_chunk(ct_hash));
-
-	try {
-		QPair<quint32, QByteArray> size_iv = meta_storage_->getChunkSizeIv(ct_hash);
-		blob chunk_pt_v = Meta::Chunk::decrypt(chunk, size_iv.first, params_.secret.get_Encryption_Key(), conv_bytearray(size_iv.second));
-		return conv_bytearray(chunk_pt_v);
-	}catch(std::exception& e){
-		qCWarning(log_assembler) << "Could not get plaintext chunk (which is marked as existing in index), DB collision";
-		throw ChunkStorage::no_such_chunk();
-	}
-}
-
 void AssemblerWorker::run() noexcept {
 	LOGFUNC();
 
 	normpath_ = QByteArray::fromStdString(meta_.path(params_.secret));
 	denormpath_ = path_normalizer_->denormalizePath(normpath_);
 
+	bool assembled = false;
 	try {
-		bool assembled = false;
 		switch(meta_.meta_type()) {
 			case Meta::FILE: assembled = assemble_file();
 				break;
@@ -111,6 +108,8 @@ void AssemblerWorker::run() noexcept {
 	}catch(std::exception& e) {
 		qCWarning(log_assembler) << "Unknown exception while assembling:" << meta_.path(params_.secret).c_str() << "E:" << e.what();    // FIXME: #83
 	}
+
+	emit finishedAssemble(conv_bytearray(meta_.path_id()), assembled, chunks_missing_);
 }
 
 bool AssemblerWorker::assemble_deleted() {
@@ -149,28 +148,62 @@ bool AssemblerWorker::assemble_directory() {
 bool AssemblerWorker::assemble_file() {
 	LOGFUNC();
 
-	// Check if we have all needed chunks
-	for(auto b : chunk_storage_->make_bitfield(meta_))
-		if(!b) return false;    // retreat!
+	// Check if we have all needed chunks, or can copy them from local files
+	for(auto b : chunk_storage_->make_reusable_bitfield(meta_)) {
+		if(!b) {
+			if(!staging_path_.isEmpty())
+				QFile::remove(staging_path_);   // Will be staged again
+			chunks_missing_ = true;
+			return false;    // retreat!
+		}
+	}
 
-	//
-	QString assembly_path = params_.system_path + "/" + conv_fspath(boost::filesystem::unique_path("assemble-%%%%-%%%%-%%%%-%%%%"));
+	// Progressive assembly has already written a part of chunks into the staging file
+	bool staged = !staging_path_.isEmpty();
+	QString assembly_path = staged ? staging_path_ : params_.system_path + "/" + conv_fspath(boost::filesystem::unique_path("assemble-%%%%-%%%%-%%%%-%%%%"));
 
-	// TODO: Check for assembled chunk and try to extract them and push into encstorage.
-	QSaveFile assembly_f(assembly_path); // Opening file
-	if(! assembly_f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+	// assemble-* file is already a temporary file, which is renamed into place, so QSaveFile is not needed here
+	QFile assembly_f(assembly_path); // Opening file
+	if(! assembly_f.open(staged ? (QIODevice::ReadWrite | QIODevice::Unbuffered) : (QIODevice::ReadWrite | QIODevice::Truncate | QIODevice::Unbuffered))) {
 		qCWarning(log_assembler) << "File cannot be opened:" << assembly_path << "E:" << assembly_f.errorString();  // FIXME: #83
 		throw abort_assembly();
 	}
 
-	for(auto chunk : meta_.chunks()) {
-		assembly_f.write(get_chunk_pt(chunk.ct_hash)); // Writing to file
+	quint64 offset = 0;
+	unsigned copied_chunks = 0;
+	for(auto& chunk : meta_.chunks()) {
+		if(staged_chunks_.contains(conv_bytearray(chunk.ct_hash))) {
+			// Already written into the staging file
+		}else if(copy_local_chunk(assembly_f, offset, chunk))
+			copied_chunks++;
+		else {
+			blob chunk_pt;
+			try {
+				chunk_pt = chunk_storage_->get_chunk_pt(chunk.ct_hash);
+			}catch(ChunkStorage::no_such_chunk& e) {
+				// Local copy was expected, but its source has changed. Retreating until the chunk is downloaded
+				assembly_f.close();
+				QFile::remove(assembly_path);
+				chunks_missing_ = true;
+				return false;
+			}
+			if(!assembly_f.seek(offset) || assembly_f.write((const char*)chunk_pt.data(), chunk_pt.size()) != (qint64)chunk_pt.size()) {
+				qCWarning(log_assembler) << "File cannot be written:" << assembly_path << "E:" << assembly_f.errorString(); // FIXME: #83
+				QFile::remove(assembly_path);
+				throw abort_assembly();
+			}
+		}
+		offset += chunk.size;
 	}
-
-	if(!assembly_f.commit()) {
-		qCWarning(log_assembler) << "File cannot be written:" << assembly_path << "E:" << assembly_f.errorString(); // FIXME: #83
+	// Encrypted chunks are removed by cleanup() after this, so the file must be on disk before it replaces the original
+	if(!sync_file(assembly_f)) {
+		qCWarning(log_assembler) << "File cannot be synced:" << assembly_path << "E:" << assembly_f.errorString(); // FIXME: #83
+		QFile::remove(assembly_path);
 		throw abort_assembly();
 	}
+	assembly_f.close();
+	if(copied_chunks)
+		qCDebug(log_assembler) << "Copied" << copied_chunks << "of" << meta_.chunks().size() << "chunks from local files";
 
 	{
 		boost::system::error_code ec;
@@ -190,10 +223,59 @@ bool AssemblerWorker::assemble_file() {
 		qCWarning(log_assembler) << "File cannot be moved to its final location:" << denormpath_ << "Current location:" << assembly_path;   // FIXME: #83
 		throw abort_assembly();
 	}
+	sync_directory(QFileInfo(denormpath_).absolutePath());
 
 	return true;
 }
 
+bool AssemblerWorker::copy_local_chunk(QFile& assembly_f, quint64 assembly_offset, const Meta::Chunk& chunk) {
+	// Identical plaintext can be in a file with different ct_hash (different IV), e.g. when a file is moved or copied by remote peer
+	for(auto& local_chunk : chunk_storage_->find_local_chunk(chunk.pt_hmac)) {
+		if(local_chunk.size != chunk.size) continue;
+
+		QFile src_f(local_chunk.path);
+		if(!src_f.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) continue;
+		if(copy_range(src_f, local_chunk.offset, assembly_f, assembly_offset, chunk.size) && verify_range(assembly_f, assembly_offset, chunk))
+			return true;
+	}
+	return false;
+}
+
+bool AssemblerWorker::verify_range(QFile& f, quint64 offset, const Meta::Chunk& chunk) {
+	// Source file could be modified within the same second as its mtime, so the copied plaintext itself is checked
+	if(!f.seek(offset)) return false;
+	QByteArray data = f.read(chunk.size);
+	if(data.size() != (int)chunk.size) return false;
+
+	return (conv_bytearray(data) | crypto::HMAC_SHA3_224(params_.secret.get_Encryption_Key())) == chunk.pt_hmac;
+}
+
+bool AssemblerWorker::copy_range(QFile& src_f, quint64 src_offset, QFile& dst_f, quint64 dst_offset, quint64 size) {
+#if defined(Q_OS_LINUX) && defined(SYS_copy_file_range)
+	// Data is copied inside the kernel. Filesystems with reflink support (Btrfs, XFS) can even share extents.
+	loff_t src_off = src_offset, dst_off = dst_offset;
+	quint64 left = size;
+	while(left > 0) {
+		ssize_t copied = syscall(SYS_copy_file_range, src_f.handle(), &src_off, dst_f.handle(), &dst_off, left, 0u);
+		if(copied <= 0) break;	// Not supported by kernel or filesystem. Falling back to userspace copy
+		left -= copied;
+	}
+	if(left == 0) return true;
+	src_offset += size - left;
+	dst_offset += size - left;
+	size = left;
+#endif
+	if(!src_f.seek(src_offset) || !dst_f.seek(dst_offset)) return false;
+
+	QByteArray buffer;
+	while(size > 0) {
+		buffer = src_f.read(std::min((quint64)copy_buffer_size_, size));
+		if(buffer.isEmpty() || dst_f.write(buffer) != buffer.size()) return false;
+		size -= buffer.size();
+	}
+	return true;
+}
+
 void AssemblerWorker::apply_attrib() {
 #if defined(Q_OS_UNIX)
 	if(params_.preserve_unix_attrib) {
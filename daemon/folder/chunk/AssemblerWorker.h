@@ -29,8 +29,10 @@
 #pragma once
 #include "blob.h"
 #include <librevault/SignedMeta.h>
+#include <QFile>
 #include <QObject>
 #include <QRunnable>
+#include <QSet>
 
 namespace librevault {
 
@@ -43,6 +45,10 @@ class ChunkStorage;
 class Secret;
 
 class AssemblerWorker : public QObject, public QRunnable {
+	Q_OBJECT
+signals:
+	void finishedAssemble(QByteArray path_id, bool assembled, bool chunks_missing);	// Emitted after every attempt. chunks_missing is set, if it retreated, because some chunks could not be found
+
 public:
 	struct abort_assembly : std::runtime_error {
 		explicit abort_assembly() : std::runtime_error("Assembly aborted") {}
@@ -53,7 +59,9 @@ public:
 					MetaStorage* meta_storage,
 					ChunkStorage* chunk_storage,
 					PathNormalizer* path_normalizer,
-					Archive* archive);
+					Archive* archive,
+					QString staging_path = QString(),
+					QSet<QByteArray> staged_chunks = QSet<QByteArray>());
 	virtual ~AssemblerWorker();
 
 	void run() noexcept override;
@@ -68,9 +76,14 @@ private:
 	SignedMeta smeta_;
 	const Meta& meta_;
 
+	QString staging_path_;
+	QSet<QByteArray> staged_chunks_;	// ct_hashes, written into staging_path_ before assembly
+
 	QByteArray normpath_;
 	QString denormpath_;
 
+	bool chunks_missing_ = false;
+
 	bool assemble_deleted();
 	bool assemble_symlink();
 	bool assemble_directory();
@@ -78,7 +91,11 @@ private:
 
 	void apply_attrib();
 
-	QByteArray get_chunk_pt(const blob& ct_hash) const;
+	/* Copying plaintext from local files, without decryption */
+	const qint64 copy_buffer_size_ = 1024*1024;
+	bool copy_local_chunk(QFile& assembly_f, quint64 assembly_offset, const Meta::Chunk& chunk);
+	bool copy_range(QFile& src_f, quint64 src_offset, QFile& dst_f, quint64 dst_offset, quint64 size);
+	bool verify_range(QFile& f, quint64 offset, const Meta::Chunk& chunk);	// Checks pt_hmac of the copied plaintext
 };
 
 } /* namespace librevault */
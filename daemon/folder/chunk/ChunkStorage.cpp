@@ -35,14 +35,18 @@
 #include "folder/meta/MetaStorage.h"
 
 #include "AssemblerQueue.h"
+#include <QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(log_assembler)
 
 namespace librevault {
 
 ChunkStorage::ChunkStorage(const FolderParams& params, MetaStorage* meta_storage, PathNormalizer* path_normalizer, QObject* parent) :
 	QObject(parent),
+	params_(params),
 	meta_storage_(meta_storage) {
 	mem_storage = new MemoryCachedStorage(this);
-	enc_storage = new EncStorage(params, this);
+	enc_storage = new EncStorage(params, meta_storage_, this);
 	if(params.secret.get_type() <= Secret::Type::ReadOnly) {
 		open_storage = new OpenStorage(params, meta_storage_, path_normalizer, this);
 		archive = new Archive(params, meta_storage_, path_normalizer, this);
@@ -50,6 +54,14 @@ ChunkStorage::ChunkStorage(const FolderParams& params, MetaStorage* meta_storage
 	}
 
 	connect(meta_storage_, &MetaStorage::metaAddedExternal, file_assembler, &AssemblerQueue::addAssemble);
+	if(file_assembler)
+		connect(file_assembler, &AssemblerQueue::metaAssembled, this, &ChunkStorage::metaAssembled);
+	connect(meta_storage_, &MetaStorage::metaAdded, this, [this](const SignedMeta& smeta){store_bitfield(smeta.meta());});
+
+	bitfield_flush_timer_ = new QTimer(this);
+	bitfield_flush_timer_->setSingleShot(true);
+	bitfield_flush_timer_->setInterval(1000);
+	connect(bitfield_flush_timer_, &QTimer::timeout, this, &ChunkStorage::flush_bitfields);
 };
 
 ChunkStorage::~ChunkStorage() {}
@@ -78,10 +90,70 @@ QByteArray ChunkStorage::get_chunk(const blob& ct_hash) {
 	}
 }
 
-void ChunkStorage::put_chunk(QByteArray ct_hash, QFile* chunk_f) {
-	enc_storage->put_chunk(ct_hash, chunk_f);
+QByteArray ChunkStorage::read_block(const blob& ct_hash, uint32_t offset, uint32_t size) {
+	try {
+		// Cache hit
+		QByteArray chunk = mem_storage->get_chunk(ct_hash);
+		if(quint64(offset) + size > quint64(chunk.size()))
+			throw no_such_chunk();
+		return chunk.mid(offset, size);
+	}catch(no_such_chunk& e) {
+		// Cache missed. Not putting the chunk into cache here, because only a block of it is read
+		try {
+			return enc_storage->read_block(ct_hash, offset, size);
+		}catch(no_such_chunk& e) {
+			if(open_storage)
+				return open_storage->read_block(ct_hash, offset, size);
+			else
+				throw;
+		}
+	}
+}
+
+blob ChunkStorage::get_chunk_pt(const blob& ct_hash) {
+	blob chunk = conv_bytearray(get_chunk(ct_hash));
+
+	try {
+		QPair<quint32, QByteArray> size_iv = meta_storage_->getChunkSizeIv(ct_hash);
+		return Meta::Chunk::decrypt(chunk, size_iv.first, params_.secret.get_Encryption_Key(), conv_bytearray(size_iv.second));
+	}catch(std::exception& e){
+		qCWarning(log_assembler) << "Could not get plaintext chunk (which is marked as existing in index), DB collision";
+		throw no_such_chunk();
+	}
+}
+
+QList<LocalChunk> ChunkStorage::find_local_chunk(const blob& pt_hmac) {
+	return open_storage ? open_storage->find_local_chunk(pt_hmac) : QList<LocalChunk>();
+}
+
+bool ChunkStorage::put_chunk(QByteArray ct_hash, QFile* chunk_f) {
+	if(open_storage && open_storage->have_chunk(conv_bytearray(ct_hash))) {
+		// Assembled from local copies while it was downloaded. Encrypted copy would never be cleaned up
+		chunk_f->remove();
+		chunk_f->deleteLater();
+	}else if(!enc_storage->put_chunk(ct_hash, chunk_f))
+		return false;
+	handle_added_chunk(ct_hash);
+	return true;
+}
+
+bool ChunkStorage::put_chunk(QByteArray ct_hash, QByteArray chunk_ct) {
+	if(open_storage && open_storage->have_chunk(conv_bytearray(ct_hash))) {
+		handle_added_chunk(ct_hash);	// Assembled from local copies while it was downloaded
+		return true;
+	}
+	if(!enc_storage->put_chunk(ct_hash, chunk_ct))
+		return false;
+	mem_storage->put_chunk(conv_bytearray(ct_hash), chunk_ct); // Already in memory, and likely to be read by assembler soon
+	handle_added_chunk(ct_hash);
+	return true;
+}
+
+void ChunkStorage::handle_added_chunk(const QByteArray& ct_hash) {
 	for(auto& smeta : meta_storage_->containingChunk(conv_bytearray(ct_hash)))
-		file_assembler->addAssemble(smeta);
+		update_bitfield(smeta.meta(), conv_bytearray(ct_hash));
+	if(file_assembler)
+		file_assembler->chunkAdded(ct_hash);
 
 	emit chunkAdded(conv_bytearray(ct_hash));
 }
@@ -99,6 +171,98 @@ bitfield_type ChunkStorage::make_bitfield(const Meta& meta) const noexcept {
 		return bitfield_type();
 }
 
+bitfield_type ChunkStorage::make_bitfield(const Meta& meta, const QByteArray& stored_bitfield) noexcept {
+	if(meta.meta_type() != meta.FILE)
+		return bitfield_type();
+
+	// Pending bitfield is not written to index yet, but it is newer
+	QByteArray current_bitfield = pending_bitfields_.value(conv_bytearray(meta.path_id()), stored_bitfield);
+
+	// Full bitfield can't become outdated, we don't remove chunks of existing Metas. Partial one could be filled by chunks of other files.
+	bitfield_type bitfield = unpack_bitfield(current_bitfield, meta.chunks().size());
+	bool full = !current_bitfield.isNull();
+	for(size_t i = 0; full && i < bitfield.size(); i++)
+		full = bitfield[i];
+	if(full)
+		return bitfield;
+
+	bitfield = make_bitfield(meta);
+	QByteArray packed = pack_bitfield(bitfield);
+	if(packed != current_bitfield)
+		put_stored_bitfield(meta.path_id(), packed);
+	return bitfield;
+}
+
+bitfield_type ChunkStorage::make_reusable_bitfield(const Meta& meta) noexcept {
+	bitfield_type bitfield = make_bitfield(meta);
+	for(size_t i = 0; i < bitfield.size(); i++) {
+		if(!bitfield[i]) {
+			try {
+				bitfield[i] = !find_local_chunk(meta.chunks().at(i).pt_hmac).isEmpty();
+			}catch(std::exception& e){}
+		}
+	}
+	return bitfield;
+}
+
+void ChunkStorage::store_bitfield(const Meta& meta) noexcept {
+	if(meta.meta_type() == meta.FILE)
+		put_stored_bitfield(meta.path_id(), pack_bitfield(make_bitfield(meta)));
+}
+
+void ChunkStorage::update_bitfield(const Meta& meta, const blob& ct_hash) noexcept {
+	if(meta.meta_type() != meta.FILE) return;
+
+	QByteArray packed = get_stored_bitfield(meta.path_id());
+	if((size_t)packed.size() != (meta.chunks().size()+7)/8) {
+		store_bitfield(meta);   // Stored for another revision, or not stored at all
+		return;
+	}
+
+	// Only setting bits of the added chunk, instead of looking up every chunk of the Meta
+	for(size_t i = 0; i < meta.chunks().size(); i++)
+		if(meta.chunks().at(i).ct_hash == ct_hash)
+			packed[int(i/8)] = packed[int(i/8)] | char(1 << (i%8));
+	put_stored_bitfield(meta.path_id(), packed);
+}
+
+QByteArray ChunkStorage::get_stored_bitfield(const blob& path_id) {
+	auto pending_it = pending_bitfields_.find(conv_bytearray(path_id));
+	if(pending_it != pending_bitfields_.end())
+		return *pending_it;
+	return meta_storage_->getBitfield(path_id);
+}
+
+void ChunkStorage::put_stored_bitfield(const blob& path_id, const QByteArray& packed) {
+	pending_bitfields_.insert(conv_bytearray(path_id), packed);
+	if(!bitfield_flush_timer_->isActive())
+		bitfield_flush_timer_->start();
+}
+
+void ChunkStorage::flush_bitfields() {
+	// Written from the main thread, so all of them join the current index batch
+	for(auto pending_it = pending_bitfields_.begin(); pending_it != pending_bitfields_.end(); ++pending_it)
+		meta_storage_->putBitfield(conv_bytearray(pending_it.key()), pending_it.value());
+	pending_bitfields_.clear();
+}
+
+QByteArray ChunkStorage::pack_bitfield(const bitfield_type& bitfield) {
+	QByteArray packed((int)(bitfield.size()+7)/8, 0);
+	for(size_t i = 0; i < bitfield.size(); i++)
+		if(bitfield[i])
+			packed[int(i/8)] = packed[int(i/8)] | char(1 << (i%8));
+	return packed;
+}
+
+bitfield_type ChunkStorage::unpack_bitfield(const QByteArray& packed, size_t size) {
+	bitfield_type bitfield(size);
+	if((size_t)packed.size() != (size+7)/8)
+		return bitfield;	// Stored for another revision, or not stored at all
+	for(size_t i = 0; i < size; i++)
+		bitfield[i] = (packed[int(i/8)] >> (i%8)) & 1;
+	return bitfield;
+}
+
 void ChunkStorage::cleanup(const Meta& meta) {
 	for(auto chunk : meta.chunks())
 		if(open_storage->have_chunk(chunk.ct_hash))
@@ -27,10 +27,13 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "OpenStorage.h"
 #include "blob.h"
-#include <librevault/Meta.h>
+#include <librevault/SignedMeta.h>
 #include <librevault/util/conv_bitfield.h>
 #include <QFile>
+#include <QHash>
+#include <QTimer>
 
 namespace librevault {
 
@@ -40,7 +43,6 @@ class PathNormalizer;
 
 class MemoryCachedStorage;
 class EncStorage;
-class OpenStorage;
 class Archive;
 class AssemblerQueue;
 
@@ -56,23 +58,45 @@ public:
 
 	bool have_chunk(const blob& ct_hash) const noexcept ;
 	QByteArray get_chunk(const blob& ct_hash);  // Throws AbstractFolder::no_such_chunk
-	void put_chunk(QByteArray ct_hash, QFile* chunk_f);
+	QByteArray read_block(const blob& ct_hash, uint32_t offset, uint32_t size);  // Reads only a part of chunk. Throws AbstractFolder::no_such_chunk
+	blob get_chunk_pt(const blob& ct_hash);  // Decrypted chunk. Throws AbstractFolder::no_such_chunk
+	bool put_chunk(QByteArray ct_hash, QFile* chunk_f);   // Returns false, if the chunk could not be stored. Then it is not announced
+	bool put_chunk(QByteArray ct_hash, QByteArray chunk_ct);   // Chunk, which was downloaded into memory
+	QList<LocalChunk> find_local_chunk(const blob& pt_hmac);	// Plaintext copies of chunk in assembled files, found by pt_hmac
 
 	bitfield_type make_bitfield(const Meta& meta) const noexcept;   // Bulk version of "have_chunk"
+	bitfield_type make_bitfield(const Meta& meta, const QByteArray& stored_bitfield) noexcept;   // Uses stored bitfield, if it is full. Otherwise, makes and stores a new one
+	bitfield_type make_reusable_bitfield(const Meta& meta) noexcept;   // Also marks chunks, which are not stored, but can be copied from local files on assembly. Not for sending to peers
 
 	void cleanup(const Meta& meta);
 
 signals:
 	void chunkAdded(blob ct_hash);
+	void metaAssembled(SignedMeta smeta);
 
 protected:
+	const FolderParams& params_;
 	MetaStorage* meta_storage_;
 
+	void handle_added_chunk(const QByteArray& ct_hash);
+	void store_bitfield(const Meta& meta) noexcept;
+	void update_bitfield(const Meta& meta, const blob& ct_hash) noexcept;	// Sets bits of a newly added chunk in the stored bitfield
+
+	/* Stored bitfields are updated in memory and written to index in batches, not on every added chunk.
+	 * Losing unwritten ones on exit is harmless: a partial stored bitfield is recomputed by make_bitfield() */
+	QHash<QByteArray, QByteArray> pending_bitfields_;	// path_id -> packed bitfield
+	QTimer* bitfield_flush_timer_;
+	QByteArray get_stored_bitfield(const blob& path_id);
+	void put_stored_bitfield(const blob& path_id, const QByteArray& packed);
+	void flush_bitfields();
+	static QByteArray pack_bitfield(const bitfield_type& bitfield);
+	static bitfield_type unpack_bitfield(const QByteArray& packed, size_t size);
+
 	MemoryCachedStorage* mem_storage;
 	EncStorage* enc_storage;
-	OpenStorage* open_storage;
-	Archive* archive;
-	AssemblerQueue* file_assembler;
+	OpenStorage* open_storage = nullptr;
+	Archive* archive = nullptr;
+	AssemblerQueue* file_assembler = nullptr;
 };
 
 } /* namespace librevault */
@@ -30,30 +30,43 @@
 #include "blob.h"
 #include "util/log.h"
 #include <QFile>
-#include <QReadWriteLock>
 #include <memory>
 
 namespace librevault {
 
 class FolderParams;
+class MetaStorage;
+
+struct EncStorageBackend : public QObject {
+	Q_OBJECT
+public:
+	virtual bool have_chunk(const blob& ct_hash) const noexcept = 0;
+	virtual QByteArray get_chunk(const blob& ct_hash) const = 0;
+	virtual QByteArray read_block(const blob& ct_hash, uint32_t offset, uint32_t size) const = 0;
+	// Return false, if the chunk could not be stored
+	virtual bool put_chunk(const QByteArray& ct_hash, QFile* chunk_f) = 0;
+	virtual bool put_chunk(const QByteArray& ct_hash, const QByteArray& chunk_ct) = 0;
+	virtual void remove_chunk(const blob& ct_hash) = 0;
+
+protected:
+	EncStorageBackend(QObject* parent) : QObject(parent) {}
+};
+
 class EncStorage : public QObject {
 	Q_OBJECT
 	LOG_SCOPE("EncStorage");
 public:
-	EncStorage(const FolderParams& params, QObject* parent);
+	EncStorage(const FolderParams& params, MetaStorage* meta_storage, QObject* parent);
 
-	bool have_chunk(const blob& ct_hash) const noexcept;
-	QByteArray get_chunk(const blob& ct_hash) const;
-	void put_chunk(const QByteArray& ct_hash, QFile* chunk_f);
-	void remove_chunk(const blob& ct_hash);
+	bool have_chunk(const blob& ct_hash) const noexcept {return backend_->have_chunk(ct_hash);}
+	QByteArray get_chunk(const blob& ct_hash) const {return backend_->get_chunk(ct_hash);}
+	QByteArray read_block(const blob& ct_hash, uint32_t offset, uint32_t size) const {return backend_->read_block(ct_hash, offset, size);}
+	bool put_chunk(const QByteArray& ct_hash, QFile* chunk_f) {return backend_->put_chunk(ct_hash, chunk_f);}
+	bool put_chunk(const QByteArray& ct_hash, const QByteArray& chunk_ct) {return backend_->put_chunk(ct_hash, chunk_ct);}
+	void remove_chunk(const blob& ct_hash) {backend_->remove_chunk(ct_hash);}
 
 private:
-	const FolderParams& params_;
-	mutable QReadWriteLock storage_mtx_;
-
-	QString make_chunk_ct_name(QByteArray ct_hash) const noexcept;
-	QString make_chunk_ct_path(const blob& ct_hash) const noexcept;
-	QString make_chunk_ct_path(QByteArray ct_hash) const noexcept;
+	EncStorageBackend* backend_;
 };
 
 } /* namespace librevault */
@@ -0,0 +1,190 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "FileEncStorage.h"
+#include "ChunkStorage.h"
+#include "control/FolderParams.h"
+#include "util/readable.h"
+#include <librevault/crypto/Base32.h>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+
+namespace librevault {
+
+FileEncStorage::FileEncStorage(const FolderParams& params, QObject* parent) : EncStorageBackend(parent), params_(params) {
+	chunks_path_ = params_.system_path + "/chunks";
+	QDir().mkpath(chunks_path_);
+	migrateFlatLayout();
+	loadChunkNames();
+}
+
+void FileEncStorage::loadChunkNames() {
+	QDirIterator dir_it(chunks_path_, QStringList() << "chunk-*", QDir::Files | QDir::Hidden, QDirIterator::Subdirectories);
+	while(dir_it.hasNext()) {
+		dir_it.next();
+		chunk_names_.insert(dir_it.fileName());
+		existing_shards_.insert(dir_it.fileInfo().path());
+	}
+	LOGD("Found" << chunk_names_.size() << "chunks");
+}
+
+void FileEncStorage::migrateFlatLayout() {
+	// Older versions kept all chunks directly in system_path
+	QDirIterator dir_it(params_.system_path, QStringList() << "chunk-*", QDir::Files | QDir::Hidden);
+	int migrated = 0;
+	while(dir_it.hasNext()) {
+		dir_it.next();
+		QString shard = make_chunk_shard(dir_it.fileName());
+		QDir().mkpath(shard);
+		if(QFile::rename(dir_it.filePath(), shard + "/" + dir_it.fileName()))
+			migrated++;
+		else
+			LOGW("Could not move" << dir_it.filePath() << "to" << shard);
+	}
+	if(migrated)
+		LOGD("Moved" << migrated << "chunks to sharded layout");
+}
+
+QString FileEncStorage::make_chunk_shard(const QString& chunk_name) const noexcept {
+	return chunks_path_ + "/" + chunk_name.mid(QStringLiteral("chunk-").size(), shard_prefix_size_);
+}
+
+QString FileEncStorage::make_chunk_ct_name(QByteArray ct_hash) const noexcept {
+	return "chunk-" + QString::fromStdString(crypto::Base32().to_string(ct_hash));
+}
+
+QString FileEncStorage::make_chunk_ct_path(const blob& ct_hash) const noexcept {
+	return make_chunk_ct_path(conv_bytearray(ct_hash));
+}
+
+QString FileEncStorage::make_chunk_ct_path(QByteArray ct_hash) const noexcept {
+	QString chunk_name = make_chunk_ct_name(ct_hash);
+	return make_chunk_shard(chunk_name) + "/" + chunk_name;
+}
+
+bool FileEncStorage::have_chunk(const blob& ct_hash) const noexcept {
+	QReadLocker lk(&storage_mtx_);
+	return chunk_names_.contains(make_chunk_ct_name(conv_bytearray(ct_hash)));
+}
+
+QByteArray FileEncStorage::get_chunk(const blob& ct_hash) const {
+	QReadLocker lk(&storage_mtx_);
+
+	QFile chunk_file(make_chunk_ct_path(ct_hash));
+	if(!chunk_file.open(QIODevice::ReadOnly))
+		throw ChunkStorage::no_such_chunk();
+
+	return chunk_file.readAll();
+}
+
+QByteArray FileEncStorage::read_block(const blob& ct_hash, uint32_t offset, uint32_t size) const {
+	QReadLocker lk(&storage_mtx_);
+
+	QFile chunk_file(make_chunk_ct_path(ct_hash));
+	if(!chunk_file.open(QIODevice::ReadOnly | QIODevice::Unbuffered))	// Unbuffered, so only the requested range is read
+		throw ChunkStorage::no_such_chunk();
+	if(quint64(offset) + size > quint64(chunk_file.size()) || !chunk_file.seek(offset))
+		throw ChunkStorage::no_such_chunk();
+
+	QByteArray block = chunk_file.read(size);
+	if(block.size() != (int)size)
+		throw ChunkStorage::no_such_chunk();
+	return block;
+}
+
+QString FileEncStorage::prepare_chunk_ct_path(const QByteArray& ct_hash) {
+	QString chunk_path = make_chunk_ct_path(ct_hash);
+	QString shard = QFileInfo(chunk_path).path();
+	if(!existing_shards_.contains(shard)) {
+		QDir().mkpath(shard);
+		existing_shards_.insert(shard);
+	}
+	return chunk_path;
+}
+
+bool FileEncStorage::put_chunk(const QByteArray& ct_hash, QFile* chunk_f) {
+	QWriteLocker lk(&storage_mtx_);
+
+	QString chunk_path = prepare_chunk_ct_path(ct_hash);
+
+	chunk_f->setParent(this);
+	chunk_f->deleteLater();
+	if(!move_chunk(ct_hash, chunk_f, chunk_path))
+		return false;
+
+	LOGD("Encrypted block" << ct_hash_readable(ct_hash) << "pushed into EncStorage");
+	return true;
+}
+
+bool FileEncStorage::put_chunk(const QByteArray& ct_hash, const QByteArray& chunk_ct) {
+	QWriteLocker lk(&storage_mtx_);
+
+	QString chunk_path = prepare_chunk_ct_path(ct_hash);
+
+	// Written next to its final location under a name, not matched by loadChunkNames(). So, a partially written chunk is never found
+	QFile chunk_f(QFileInfo(chunk_path).path() + "/incomplete-" + make_chunk_ct_name(ct_hash));
+	if(!chunk_f.open(QIODevice::WriteOnly | QIODevice::Truncate) || chunk_f.write(chunk_ct) != chunk_ct.size()) {
+		LOGW("Could not write encrypted block" << ct_hash_readable(ct_hash) << "E:" << chunk_f.errorString());
+		chunk_f.remove();
+		return false;
+	}
+	chunk_f.close();
+	if(!move_chunk(ct_hash, &chunk_f, chunk_path))
+		return false;
+
+	LOGD("Encrypted block" << ct_hash_readable(ct_hash) << "pushed into EncStorage");
+	return true;
+}
+
+bool FileEncStorage::move_chunk(const QByteArray& ct_hash, QFile* chunk_f, const QString& chunk_path) {
+	QString chunk_name = make_chunk_ct_name(ct_hash);
+	if(chunk_names_.contains(chunk_name)) {
+		// The same chunk is already stored, and rename() doesn't overwrite it
+		chunk_f->remove();
+		return true;
+	}
+
+	if(!chunk_f->rename(chunk_path)) {
+		LOGW("Could not move encrypted block" << ct_hash_readable(ct_hash) << "into EncStorage E:" << chunk_f->errorString());
+		chunk_f->remove();
+		return false;
+	}
+	chunk_names_.insert(chunk_name);
+	return true;
+}
+
+void FileEncStorage::remove_chunk(const blob& ct_hash) {
+	QWriteLocker lk(&storage_mtx_);
+	QFile::remove(make_chunk_ct_path(ct_hash));
+	chunk_names_.remove(make_chunk_ct_name(conv_bytearray(ct_hash)));
+
+	LOGD("Block" << ct_hash_readable(ct_hash) << "removed from EncStorage");
+}
+
+} /* namespace librevault */
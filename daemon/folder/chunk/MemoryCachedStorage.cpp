@@ -28,36 +28,112 @@
  */
 #include "MemoryCachedStorage.h"
 #include "ChunkStorage.h"
+#include "control/Config.h"
+#include <algorithm>
 
 namespace librevault {
 
-MemoryCachedStorage::MemoryCachedStorage(QObject* parent) : QObject(parent), cache_(50*1024*1024) {}    // 50 MB cache is enough for most purposes
+MemoryCachedStorage::MemoryCachedStorage(QObject* parent) : QObject(parent) {
+	capacity_ = Config::get()->getGlobal("chunk_cache_size").toLongLong();
+	protected_capacity_ = capacity_ * 4 / 5;
+}
 
 bool MemoryCachedStorage::have_chunk(const blob& ct_hash) const noexcept {
-	return cache_.contains(conv_bytearray(ct_hash));
+	QByteArray key = conv_bytearray(ct_hash);
+	Shard& shard = shardFor(key);
+	QMutexLocker lk(&shard.lock);
+
+	return shard.entries.contains(key);
 }
 
 QByteArray MemoryCachedStorage::get_chunk(const blob& ct_hash) const {
-	QMutexLocker lk(&cache_lock_);
+	QByteArray key = conv_bytearray(ct_hash);
+	Shard& shard = shardFor(key);
+	QMutexLocker lk(&shard.lock);
 
-	QByteArray* cached_chunk = cache_[conv_bytearray(ct_hash)];
-	if(cached_chunk)
-		return *cached_chunk;
-	else
+	auto entry_it = shard.entries.find(key);
+	if(entry_it == shard.entries.end())
 		throw ChunkStorage::no_such_chunk();
+
+	EntryList::iterator it = *entry_it;
+	if(it->is_protected) {
+		shard.protected_.splice(shard.protected_.begin(), shard.protected_, it);
+	}else{
+		// Repeated hit. Promoting to protected segment
+		it->is_protected = true;
+		protected_size_ += it->data.size();
+		shard.protected_.splice(shard.protected_.begin(), shard.probation, it);
+
+		// Demoting least recently used protected chunks of this shard back to probation. Total size is not changed, nothing to evict
+		while(protected_size_ > protected_capacity_ && std::prev(shard.protected_.end()) != it) {
+			auto demoted = std::prev(shard.protected_.end());
+			demoted->is_protected = false;
+			protected_size_ -= demoted->data.size();
+			shard.probation.splice(shard.probation.begin(), shard.protected_, demoted);
+		}
+	}
+	return it->data;	// Implicitly shared, no copy here
 }
 
 void MemoryCachedStorage::put_chunk(const blob& ct_hash, QByteArray data) {
-	QMutexLocker lk(&cache_lock_);
+	if(data.size() > capacity_ / 4) return;	// Admission control: such chunk would evict a significant part of the cache
 
-	QByteArray* cached_chunk = new QByteArray(data);
-	cache_.insert(conv_bytearray(ct_hash), cached_chunk, cached_chunk->size());
+	QByteArray key = conv_bytearray(ct_hash);
+	{
+		Shard& shard = shardFor(key);
+		QMutexLocker lk(&shard.lock);
+
+		if(shard.entries.contains(key)) return;	// Chunks are immutable, so there is nothing to update
+
+		shard.probation.push_front(Entry{key, data, false});
+		shard.entries.insert(key, shard.probation.begin());
+		size_ += data.size();
+	}
+	evict();
 }
 
 void MemoryCachedStorage::remove_chunk(const blob& ct_hash) noexcept {
-	QMutexLocker lk(&cache_lock_);
+	QByteArray key = conv_bytearray(ct_hash);
+	Shard& shard = shardFor(key);
+	QMutexLocker lk(&shard.lock);
+
+	auto entry_it = shard.entries.find(key);
+	if(entry_it != shard.entries.end())
+		erase(shard, *entry_it);
+}
+
+void MemoryCachedStorage::evict() {
+	// Least recently used chunks of every shard are evicted in turns. Probation first, protected only if probation of all shards is empty
+	for(bool from_protected : {false, true}) {
+		int empty_shards = 0;
+		while(size_ > capacity_ && empty_shards < shard_count_) {
+			Shard& shard = shards_[evict_cursor_++ % shard_count_];
+			QMutexLocker lk(&shard.lock);
+
+			EntryList& segment = from_protected ? shard.protected_ : shard.probation;
+			if(segment.empty()) {
+				empty_shards++;
+				continue;
+			}
+			empty_shards = 0;
+			erase(shard, std::prev(segment.end()));
+		}
+	}
+}
+
+MemoryCachedStorage::Shard& MemoryCachedStorage::shardFor(const QByteArray& ct_hash) const {
+	// ct_hash is a cryptographic hash already, its first byte is distributed uniformly
+	return shards_[ct_hash.isEmpty() ? 0 : (quint8)ct_hash[0] % shard_count_];
+}
 
-	cache_.remove(conv_bytearray(ct_hash));
+void MemoryCachedStorage::erase(Shard& shard, EntryList::iterator it) {
+	shard.entries.remove(it->ct_hash);
+	size_ -= it->data.size();
+	if(it->is_protected) {
+		protected_size_ -= it->data.size();
+		shard.protected_.erase(it);
+	}else
+		shard.probation.erase(it);
 }
 
 } /* namespace librevault */
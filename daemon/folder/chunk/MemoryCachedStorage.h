@@ -29,12 +29,20 @@
 #pragma once
 #include "blob.h"
 #include <QByteArray>
-#include <QCache>
+#include <QHash>
 #include <QMutex>
 #include <QObject>
+#include <array>
+#include <atomic>
+#include <list>
 
 namespace librevault {
 
+/* Chunk cache, split into shards by ct_hash, so readers of different chunks don't wait for each other.
+ * Every shard is a segmented LRU: new chunks go to "probation" segment and are moved to "protected" segment on a repeated hit.
+ * Capacity is shared by all shards, so the number of shards doesn't depend on the cache size. Shards are evicted in turns,
+ * probation first, so a single pass over many chunks (e.g. assembling a big file) doesn't evict chunks, requested by peers over and over.
+ * Chunks are stored as QByteArray, so get_chunk returns a shared buffer without copying data. */
 class MemoryCachedStorage : public QObject {
 	Q_OBJECT
 public:
@@ -46,8 +54,29 @@ public:
 	void remove_chunk(const blob& ct_hash) noexcept;
 
 private:
-	mutable QMutex cache_lock_;
-	QCache<QByteArray, QByteArray> cache_;
+	struct Entry {
+		QByteArray ct_hash;
+		QByteArray data;
+		bool is_protected;
+	};
+	using EntryList = std::list<Entry>;
+
+	struct Shard {
+		QMutex lock;
+		EntryList probation, protected_;	// Most recently used are at front
+		QHash<QByteArray, EntryList::iterator> entries;
+	};
+
+	static constexpr int shard_count_ = 16;
+	mutable std::array<Shard, shard_count_> shards_;
+	qint64 capacity_;
+	qint64 protected_capacity_;	// Part of the capacity, reserved for chunks with repeated hits
+	mutable std::atomic<qint64> size_{0}, protected_size_{0};	// Of all shards
+	std::atomic<unsigned> evict_cursor_{0};
+
+	Shard& shardFor(const QByteArray& ct_hash) const;
+	void evict();	// Brings size within capacity. Locks one shard at a time, so it must be called without a shard locked
+	void erase(Shard& shard, EntryList::iterator it);
 };
 
 } /* namespace librevault */
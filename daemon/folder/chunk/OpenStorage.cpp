@@ -32,6 +32,7 @@
 #include "folder/meta/MetaStorage.h"
 #include "folder/PathNormalizer.h"
 #include "util/readable.h"
+#include <boost/filesystem.hpp>
 
 namespace librevault {
 
@@ -76,4 +77,68 @@ QByteArray OpenStorage::get_chunk(const blob& ct_hash) const {
 	throw ChunkStorage::no_such_chunk();
 }
 
+QList<LocalChunk> OpenStorage::find_local_chunk(const blob& pt_hmac) const {
+	QList<LocalChunk> locations;
+	foreach(auto& smeta, meta_storage_->containingAssembledPlaintext(pt_hmac)) {
+		QString path = path_normalizer_->denormalizePath(QByteArray::fromStdString(smeta.meta().path(params_.secret)));
+
+		// File is modified after it was indexed. Its contents can't be trusted until reindex
+		boost::system::error_code ec;
+		if(boost::filesystem::last_write_time(path.toStdWString(), ec) != smeta.meta().mtime() || ec) continue;
+
+		uint64_t offset = 0;
+		for(auto& chunk : smeta.meta().chunks()) {
+			if(chunk.pt_hmac == pt_hmac) {
+				locations << LocalChunk{path, offset, chunk.size};
+				break;
+			}
+			offset += chunk.size;
+		}
+	}
+	return locations;
+}
+
+QByteArray OpenStorage::read_block(const blob& ct_hash, uint32_t offset, uint32_t size) const {
+	QByteArray chunk_ct;
+	{
+		QMutexLocker lk(&encrypted_cache_mtx_);
+		for(int i = encrypted_cache_.size()-1; i >= 0; i--)
+			if(encrypted_cache_[i].age.hasExpired(encrypted_cache_ttl_))
+				encrypted_cache_.removeAt(i);
+
+		for(int i = 0; i < encrypted_cache_.size(); i++) {
+			if(encrypted_cache_[i].ct_hash == ct_hash) {
+				chunk_ct = encrypted_cache_[i].chunk_ct;
+				encrypted_cache_.move(i, 0);
+				break;
+			}
+		}
+	}
+
+	if(chunk_ct.isNull()) {
+		chunk_ct = get_chunk(ct_hash);	// Encrypting outside of lock
+
+		QMutexLocker lk(&encrypted_cache_mtx_);
+		// Another reader could have missed the same chunk and cached it meanwhile
+		bool cached = false;
+		for(int i = 0; i < encrypted_cache_.size() && !cached; i++) {
+			if(encrypted_cache_[i].ct_hash == ct_hash) {
+				encrypted_cache_.move(i, 0);
+				cached = true;
+			}
+		}
+		if(!cached) {
+			EncryptedChunk encrypted_chunk{ct_hash, chunk_ct, QElapsedTimer()};
+			encrypted_chunk.age.start();
+			encrypted_cache_.prepend(encrypted_chunk);
+			while(encrypted_cache_.size() > encrypted_cache_chunks_)
+				encrypted_cache_.removeLast();
+		}
+	}
+
+	if(quint64(offset) + size > quint64(chunk_ct.size()))
+		throw ChunkStorage::no_such_chunk();
+	return chunk_ct.mid(offset, size);
+}
+
 } /* namespace librevault */
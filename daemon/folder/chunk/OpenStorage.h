@@ -30,6 +30,8 @@
 #include "blob.h"
 #include "util/log.h"
 #include <librevault/Meta.h>
+#include <QElapsedTimer>
+#include <QMutex>
 #include <QObject>
 #include <memory>
 
@@ -40,6 +42,13 @@ class Secret;
 class MetaStorage;
 class PathNormalizer;
 
+/* Plaintext of a chunk in an assembled file */
+struct LocalChunk {
+	QString path;
+	quint64 offset;
+	quint32 size;
+};
+
 class OpenStorage : public QObject {
 	Q_OBJECT
 	LOG_SCOPE("OpenStorage");
@@ -48,12 +57,25 @@ public:
 
 	bool have_chunk(const blob& ct_hash) const noexcept;
 	QByteArray get_chunk(const blob& ct_hash) const;
+	QByteArray read_block(const blob& ct_hash, uint32_t offset, uint32_t size) const;
+	QList<LocalChunk> find_local_chunk(const blob& pt_hmac) const;
 
 private:
 	const FolderParams& params_;
 	MetaStorage* meta_storage_;
 	PathNormalizer* path_normalizer_;
 
+	/* Recently encrypted chunks. Blocks of one chunk are usually requested one after another, so the chunk is not encrypted again for every block */
+	struct EncryptedChunk {
+		blob ct_hash;
+		QByteArray chunk_ct;
+		QElapsedTimer age;
+	};
+	const int encrypted_cache_chunks_ = 4;
+	const qint64 encrypted_cache_ttl_ = 10000;  // ms
+	mutable QMutex encrypted_cache_mtx_;
+	mutable QList<EncryptedChunk> encrypted_cache_;	// Most recently used are at front
+
 	inline bool verify_chunk(const blob& ct_hash, const blob& chunk_pt, Meta::StrongHashType strong_hash_type) const {
 		return ct_hash == Meta::Chunk::compute_strong_hash(chunk_pt, strong_hash_type);
 	}
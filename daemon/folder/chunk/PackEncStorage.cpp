@@ -0,0 +1,217 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "PackEncStorage.h"
+#include "ChunkStorage.h"
+#include "control/FolderParams.h"
+#include "folder/meta/MetaStorage.h"
+#include "util/readable.h"
+#include "util/sync_file.h"
+#include <QDir>
+#include <QDirIterator>
+#include <QRegularExpression>
+#include <QSet>
+
+namespace librevault {
+
+PackEncStorage::PackEncStorage(const FolderParams& params, MetaStorage* meta_storage, QObject* parent) : EncStorageBackend(parent), params_(params), meta_storage_(meta_storage) {
+	packs_path_ = params_.system_path + "/packs";
+	QDir().mkpath(packs_path_);
+
+	// Segment files
+	QRegularExpression segment_regex("^pack-(\\d+)\\.dat$");
+	QDirIterator dir_it(packs_path_, QStringList() << "pack-*.dat", QDir::Files);
+	while(dir_it.hasNext()) {
+		dir_it.next();
+		auto match = segment_regex.match(dir_it.fileName());
+		if(match.hasMatch())
+			segments_[match.captured(1).toUInt()].size = dir_it.fileInfo().size();
+	}
+
+	// Chunk locations
+	for(auto& packed_chunk : meta_storage_->getPackedChunks()) {
+		Location location{packed_chunk.segment, packed_chunk.offset, packed_chunk.size};
+		if(!segments_.contains(location.segment)) continue;	// Segment file is lost, so the chunk is lost too
+		locations_.insert(packed_chunk.ct_hash, location);
+		segments_[location.segment].live += location.size;
+	}
+
+	// Segments without live chunks are left after an interrupted compaction
+	for(auto it = segments_.begin(); it != segments_.end();) {
+		if(it.value().live == 0) {
+			QFile::remove(make_segment_path(it.key()));
+			it = segments_.erase(it);
+		}else
+			++it;
+	}
+
+	current_segment_ = segments_.isEmpty() ? 0 : segments_.lastKey();
+	LOGD("Loaded" << locations_.size() << "chunks in" << segments_.size() << "segments");
+}
+
+PackEncStorage::~PackEncStorage() {}
+
+QString PackEncStorage::make_segment_path(quint32 segment) const {
+	return QStringLiteral("%1/pack-%2.dat").arg(packs_path_).arg(segment, 8, 10, QChar('0'));
+}
+
+bool PackEncStorage::have_chunk(const blob& ct_hash) const noexcept {
+	QReadLocker lk(&storage_mtx_);
+	return locations_.contains(conv_bytearray(ct_hash));
+}
+
+QByteArray PackEncStorage::get_chunk(const blob& ct_hash) const {
+	QReadLocker lk(&storage_mtx_);
+
+	auto location_it = locations_.find(conv_bytearray(ct_hash));
+	if(location_it == locations_.end())
+		throw ChunkStorage::no_such_chunk();
+	return read_range(*location_it, 0, location_it->size);
+}
+
+QByteArray PackEncStorage::read_block(const blob& ct_hash, uint32_t offset, uint32_t size) const {
+	QReadLocker lk(&storage_mtx_);
+
+	auto location_it = locations_.find(conv_bytearray(ct_hash));
+	if(location_it == locations_.end() || quint64(offset) + size > location_it->size)
+		throw ChunkStorage::no_such_chunk();
+	return read_range(*location_it, offset, size);
+}
+
+QByteArray PackEncStorage::read_range(const Location& location, quint64 offset, quint32 size) const {
+	QFile segment_file(make_segment_path(location.segment));
+	if(!segment_file.open(QIODevice::ReadOnly | QIODevice::Unbuffered) || !segment_file.seek(location.offset + offset))
+		throw ChunkStorage::no_such_chunk();
+
+	QByteArray data = segment_file.read(size);
+	if(data.size() != (int)size)
+		throw ChunkStorage::no_such_chunk();
+	return data;
+}
+
+bool PackEncStorage::put_chunk(const QByteArray& ct_hash, QFile* chunk_f) {
+	chunk_f->setParent(this);
+	chunk_f->seek(0);
+	bool stored = put_chunk(ct_hash, chunk_f->readAll());
+	chunk_f->remove();
+	chunk_f->deleteLater();
+	return stored;
+}
+
+bool PackEncStorage::put_chunk(const QByteArray& ct_hash, const QByteArray& chunk_ct) {
+	QWriteLocker lk(&storage_mtx_);
+
+	if(!locations_.contains(ct_hash)) {
+		try {
+			Location location = append(chunk_ct);
+
+			// If location is not stored, the appended data is dead space, which is reclaimed by compaction
+			meta_storage_->putPackedChunks({PackedChunk{ct_hash, location.segment, location.offset, location.size}});
+			locations_.insert(ct_hash, location);
+			segments_[location.segment].live += location.size;
+		}catch(std::exception& e) {
+			LOGW("Could not store encrypted block" << ct_hash_readable(ct_hash) << "E:" << e.what());
+			return false;
+		}
+	}
+
+	LOGD("Encrypted block" << ct_hash_readable(ct_hash) << "pushed into PackEncStorage");
+	return true;
+}
+
+void PackEncStorage::remove_chunk(const blob& ct_hash) {
+	QWriteLocker lk(&storage_mtx_);
+
+	auto location_it = locations_.find(conv_bytearray(ct_hash));
+	if(location_it == locations_.end()) return;
+	Location location = *location_it;
+
+	meta_storage_->removePackedChunk(ct_hash);
+	locations_.erase(location_it);
+
+	Segment& segment = segments_[location.segment];
+	segment.live -= location.size;
+	if(location.segment != current_segment_ && segment.live < segment.size/2)
+		compact(location.segment);
+
+	LOGD("Block" << ct_hash_readable(ct_hash) << "removed from PackEncStorage");
+}
+
+PackEncStorage::Location PackEncStorage::append(const QByteArray& chunk_ct, bool sync) {
+	if(segments_[current_segment_].size > 0 && segments_[current_segment_].size + chunk_ct.size() > segment_size_limit_)
+		current_segment_ = segments_.lastKey() + 1;	// Starting a new segment
+
+	QFile segment_file(make_segment_path(current_segment_));
+	if(!segment_file.open(QIODevice::WriteOnly | QIODevice::Append))
+		throw std::runtime_error(("Could not open segment file: " + segment_file.errorString()).toStdString());
+
+	Location location{current_segment_, (quint64)segment_file.size(), (quint32)chunk_ct.size()};
+	// Synced before its location is stored, so a committed location never points at data, lost in a crash
+	if(segment_file.write(chunk_ct) != chunk_ct.size() || !(sync ? sync_file(segment_file) : segment_file.flush()))
+		throw std::runtime_error(("Could not write segment file: " + segment_file.errorString()).toStdString());
+	if(sync && location.offset == 0)
+		sync_directory(packs_path_);	// New segment file
+
+	segments_[current_segment_].size = location.offset + location.size;
+	return location;
+}
+
+void PackEncStorage::compact(quint32 segment) {
+	LOGD("Compacting segment" << segment << "live:" << segments_[segment].live << "size:" << segments_[segment].size);
+
+	QList<PackedChunk> moved_chunks;
+	QSet<quint32> written_segments;
+	for(auto it = locations_.begin(); it != locations_.end(); ++it) {
+		if(it->segment != segment) continue;
+
+		Location new_location = append(read_range(*it, 0, it->size), false);
+		moved_chunks << PackedChunk{it.key(), new_location.segment, new_location.offset, new_location.size};
+		written_segments << new_location.segment;
+	}
+	for(quint32 written_segment : written_segments)
+		sync_segment(written_segment);	// Once per segment, not per moved chunk
+	sync_directory(packs_path_);
+	meta_storage_->putPackedChunks(moved_chunks);	// Single transaction. Chunks are removed by assembler threads, so it is committed on return
+
+	for(auto& moved_chunk : moved_chunks) {
+		locations_[moved_chunk.ct_hash] = Location{moved_chunk.segment, moved_chunk.offset, moved_chunk.size};
+		segments_[moved_chunk.segment].live += moved_chunk.size;
+	}
+
+	// Old segment is removed only after new locations are committed. If it is interrupted here, the segment is removed at startup.
+	QFile::remove(make_segment_path(segment));
+	segments_.remove(segment);
+}
+
+void PackEncStorage::sync_segment(quint32 segment) {
+	QFile segment_file(make_segment_path(segment));
+	if(!segment_file.open(QIODevice::ReadWrite) || !sync_file(segment_file))
+		throw std::runtime_error(("Could not sync segment file: " + segment_file.errorString()).toStdString());
+}
+
+} /* namespace librevault */
@@ -0,0 +1,86 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "EncStorage.h"
+#include <QHash>
+#include <QMap>
+#include <QReadWriteLock>
+
+namespace librevault {
+
+class MetaStorage;
+
+/* Chunks are appended to large segment files in system_path/packs. Location of every chunk is kept in "packed_chunk" table of the folder index,
+ * and in memory. Locations are written through the index connection, so they join its batch instead of waiting for it. Good for replicas with a lot of small chunks: it uses a handful of inodes, instead of one per chunk.
+ * When a segment has more dead space than live chunks, the live chunks are copied to the current segment and the old one is removed. */
+class PackEncStorage : public EncStorageBackend {
+	Q_OBJECT
+	LOG_SCOPE("PackEncStorage");
+public:
+	PackEncStorage(const FolderParams& params, MetaStorage* meta_storage, QObject* parent);
+	virtual ~PackEncStorage();
+
+	bool have_chunk(const blob& ct_hash) const noexcept override;
+	QByteArray get_chunk(const blob& ct_hash) const override;
+	QByteArray read_block(const blob& ct_hash, uint32_t offset, uint32_t size) const override;
+	bool put_chunk(const QByteArray& ct_hash, QFile* chunk_f) override;
+	bool put_chunk(const QByteArray& ct_hash, const QByteArray& chunk_ct) override;
+	void remove_chunk(const blob& ct_hash) override;
+
+private:
+	const FolderParams& params_;
+	MetaStorage* meta_storage_;
+	mutable QReadWriteLock storage_mtx_;
+
+	QString packs_path_;
+
+	struct Location {
+		quint32 segment;
+		quint64 offset;
+		quint32 size;
+	};
+	QHash<QByteArray, Location> locations_;
+
+	struct Segment {
+		quint64 size = 0;	// Size of segment file
+		quint64 live = 0;	// Total size of chunks, which are still in use
+	};
+	QMap<quint32, Segment> segments_;
+	quint32 current_segment_ = 0;	// Chunks are appended to this segment
+
+	const quint64 segment_size_limit_ = 64*1024*1024;
+
+	QString make_segment_path(quint32 segment) const;
+	QByteArray read_range(const Location& location, quint64 offset, quint32 size) const;
+	Location append(const QByteArray& chunk_ct, bool sync = true);	// Must be called under write lock. If sync is false, the segment must be synced by caller before its location is stored
+	void compact(quint32 segment);	// Must be called under write lock
+	void sync_segment(quint32 segment);
+};
+
+} /* namespace librevault */
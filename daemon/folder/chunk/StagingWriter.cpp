@@ -0,0 +1,87 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "StagingWriter.h"
+#include "ChunkStorage.h"
+#include "util/preallocate.h"
+#include "util/sync_file.h"
+#include <QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(log_assembler)
+
+namespace librevault {
+
+StagingWriter::StagingWriter(SignedMeta smeta, QString staging_path, QList<QByteArray> ct_hashes, ChunkStorage* chunk_storage) :
+	smeta_(smeta),
+	staging_path_(staging_path),
+	ct_hashes_(ct_hashes),
+	chunk_storage_(chunk_storage) {}
+
+StagingWriter::~StagingWriter() {}
+
+void StagingWriter::run() noexcept {
+	const Meta& meta = smeta_.meta();
+	QList<QByteArray> staged_chunks;
+
+	QFile staging_f(staging_path_);
+	if(staging_f.open(QIODevice::ReadWrite | QIODevice::Unbuffered)) {
+		// Offsets of every chunk in file. The same chunk can be found at several offsets
+		QHash<QByteArray, QList<quint64>> offsets;
+		quint64 file_size = 0;
+		for(auto& chunk : meta.chunks()) {
+			offsets[conv_bytearray(chunk.ct_hash)].append(file_size);
+			file_size += chunk.size;
+		}
+
+		if(quint64(staging_f.size()) == file_size || preallocate(staging_f, file_size)) {
+			for(auto& ct_hash : ct_hashes_) {
+				try {
+					blob chunk_pt = chunk_storage_->get_chunk_pt(conv_bytearray(ct_hash));
+
+					bool written = true;
+					for(quint64 offset : offsets.value(ct_hash))
+						written = written && staging_f.seek(offset) && staging_f.write((const char*)chunk_pt.data(), chunk_pt.size()) == (qint64)chunk_pt.size();
+					if(written)
+						staged_chunks.append(ct_hash);
+				}catch(std::exception& e) {}    // Will be written by AssemblerWorker
+			}
+
+			// Staged chunks are not written again by AssemblerWorker, so they are reported only when they are on disk
+			if(!staged_chunks.isEmpty() && !sync_file(staging_f)) {
+				qCWarning(log_assembler) << "Staging file cannot be synced:" << staging_path_ << "E:" << staging_f.errorString();
+				staged_chunks.clear();
+			}
+		}else
+			qCWarning(log_assembler) << "Could not preallocate staging file:" << staging_path_ << "E:" << staging_f.errorString();
+	}else
+		qCWarning(log_assembler) << "Staging file cannot be opened:" << staging_path_ << "E:" << staging_f.errorString();
+
+	emit finishedStaging(conv_bytearray(meta.path_id()), staging_path_, staged_chunks);
+}
+
+} /* namespace librevault */
@@ -0,0 +1,57 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <librevault/SignedMeta.h>
+#include <QObject>
+#include <QRunnable>
+
+namespace librevault {
+
+class ChunkStorage;
+
+/* StagingWriter writes available chunks of an incomplete file into its staging file, for progressive assembly */
+class StagingWriter : public QObject, public QRunnable {
+	Q_OBJECT
+signals:
+	void finishedStaging(QByteArray path_id, QString staging_path, QList<QByteArray> staged_chunks);
+
+public:
+	StagingWriter(SignedMeta smeta, QString staging_path, QList<QByteArray> ct_hashes, ChunkStorage* chunk_storage);
+	virtual ~StagingWriter();
+
+	void run() noexcept override;
+
+private:
+	SignedMeta smeta_;
+	QString staging_path_;
+	QList<QByteArray> ct_hashes_;
+	ChunkStorage* chunk_storage_;
+};
+
+} /* namespace librevault */
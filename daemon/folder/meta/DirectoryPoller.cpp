@@ -32,7 +32,7 @@
 #include "control/FolderParams.h"
 #include "folder/IgnoreList.h"
 #include "folder/PathNormalizer.h"
-#include <QDirIterator>
+#include <QFileInfo>
 
 namespace librevault {
 
@@ -61,47 +61,91 @@ void DirectoryPoller::setEnabled(bool enabled) {
 		polling_timer_->stop();
 }
 
-QList<QString> DirectoryPoller::getReindexList() {
-	QSet<QString> file_list;
+void DirectoryPoller::addPathsToQueue() {
+	if(rescanning_) {
+		LOGD("Previous rescan is still in progress");
+		return;
+	}
+	LOGD("Performing full directory rescan");
+	rescanning_ = true;
 
 	// Files present in the file system
-	qDebug() << params_.path;
-	QDirIterator dir_it(
+	dir_it_ = std::make_unique<QDirIterator>(
 		params_.path,
 		QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden | QDir::System,
 		params_.preserve_symlinks ? (QDirIterator::Subdirectories) : (QDirIterator::Subdirectories | QDirIterator::FollowSymlinks)
 	);
-	while(dir_it.hasNext()) {
-		QString abspath = dir_it.next();
-		QByteArray normpath = path_normalizer_->normalizePath(abspath);
-
-		if(!ignore_list_->isIgnored(normpath)) file_list.insert(abspath);
-	}
 
 	// Prevent incomplete (not assembled, partially-downloaded, whatever) from periodical scans.
 	// They can still be indexed by monitor, though.
-	for(auto& smeta : meta_storage_->getIncompleteMeta()) {
-		QString denormpath = path_normalizer_->denormalizePath(QByteArray::fromStdString(smeta.meta().path(params_.secret)));
-		file_list.remove(denormpath);
+	incomplete_paths_.clear();
+	meta_storage_->forEachIncompleteMeta([this](const SignedMeta& smeta){
+		incomplete_paths_.insert(path_normalizer_->denormalizePath(QByteArray::fromStdString(smeta.meta().path(params_.secret))));
+	});
+
+	emit rescanStarted();
+}
+
+void DirectoryPoller::feedPaths(int count) {
+	if(!rescanning_) return;
+
+	QStringList batch;
+	while(dir_it_ && batch.size() < count) {
+		QStringList candidates;
+		while(dir_it_->hasNext() && candidates.size() < stat_batch_size_) {
+			QString abspath = dir_it_->next();
+			QByteArray normpath = path_normalizer_->normalizePath(abspath);
+
+			if(!ignore_list_->isIgnored(normpath) && !incomplete_paths_.contains(abspath))
+				candidates << abspath;
+		}
+		batch << filterUnchanged(candidates);
+
+		if(!dir_it_->hasNext()) {
+			dir_it_.reset();
+			collectDeletedPaths();
+		}
 	}
 
-	// Files present in index (files added from here will be marked as DELETED)
-	for(auto& smeta : meta_storage_->getExistingMeta()) {
-		QByteArray normpath = QByteArray::fromStdString(smeta.meta().path(params_.secret));
-		QString denormpath = path_normalizer_->denormalizePath(normpath);
+	while(!deleted_paths_.isEmpty() && batch.size() < count)
+		batch << deleted_paths_.takeFirst();
 
-		if(!ignore_list_->isIgnored(normpath)) file_list.insert(denormpath);
+	if(!dir_it_ && deleted_paths_.isEmpty()) {
+		LOGD("Full directory rescan finished");
+		rescanning_ = false;
+		incomplete_paths_.clear();
 	}
 
-	return file_list.toList();
+	emit newPaths(batch);
 }
 
-void DirectoryPoller::addPathsToQueue() {
-	LOGD("Performing full directory rescan");
+QStringList DirectoryPoller::filterUnchanged(const QStringList& abspaths) {
+	QList<blob> path_ids;
+	path_ids.reserve(abspaths.size());
+	for(auto& abspath : abspaths)
+		path_ids << Meta::make_path_id(path_normalizer_->normalizePath(abspath).toStdString(), params_.secret);
 
-	foreach(QString denormpath, getReindexList()) {
-		emit newPath(denormpath);
+	// One query for the whole batch, instead of one per file
+	QHash<QByteArray, FileStat> indexed_stats = meta_storage_->getFileStats(path_ids);
+
+	QStringList changed;
+	for(int i = 0; i < abspaths.size(); i++) {
+		auto indexed_stat = indexed_stats.find(conv_bytearray(path_ids[i]));
+		if(indexed_stat == indexed_stats.end() || *indexed_stat != FileStat::read(abspaths[i], params_.preserve_symlinks))
+			changed << abspaths[i];
 	}
+	return changed;
+}
+
+void DirectoryPoller::collectDeletedPaths() {
+	// Files present in index, but not in the file system (they will be marked as DELETED)
+	meta_storage_->forEachExistingMeta([this](const SignedMeta& smeta){
+		QByteArray normpath = QByteArray::fromStdString(smeta.meta().path(params_.secret));
+		QString denormpath = path_normalizer_->denormalizePath(normpath);
+
+		if(!ignore_list_->isIgnored(normpath) && !QFileInfo::exists(denormpath))
+			deleted_paths_ << denormpath;
+	});
 }
 
 } /* namespace librevault */
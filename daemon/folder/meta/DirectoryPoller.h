@@ -27,9 +27,13 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "FileStat.h"
 #include "util/log.h"
 #include <librevault/Meta.h>
+#include <QDirIterator>
+#include <QSet>
 #include <QTimer>
+#include <memory>
 
 namespace librevault {
 
@@ -42,7 +46,8 @@ class DirectoryPoller : public QObject {
 	Q_OBJECT
 	LOG_SCOPE("DirectoryPoller");
 signals:
-	void newPath(QString denormpath);
+	void rescanStarted();
+	void newPaths(QStringList denormpaths);
 
 public:
 	DirectoryPoller(const FolderParams& params, IgnoreList* ignore_list, PathNormalizer* path_normalizer, MetaStorage* parent);
@@ -50,6 +55,7 @@ public:
 
 public slots:
 	void setEnabled(bool enabled);
+	void feedPaths(int count);
 
 private:
 	const FolderParams& params_;
@@ -59,7 +65,17 @@ private:
 
 	QTimer* polling_timer_;
 
-	QList<QString> getReindexList();
+	/* Current rescan. Paths are generated lazily, as the indexer asks for them */
+	bool rescanning_ = false;
+	std::unique_ptr<QDirIterator> dir_it_;
+	QSet<QString> incomplete_paths_;
+	QStringList deleted_paths_;
+
+	void collectDeletedPaths();
+
+	/* Stat-based skip. Paths with the same stat, as recorded at the last indexing, are not sent to the indexer */
+	const int stat_batch_size_ = 256;
+	QStringList filterUnchanged(const QStringList& abspaths);
 
 	void addPathsToQueue();
 };
@@ -0,0 +1,68 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "FileStat.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#ifdef Q_OS_UNIX
+#   include <sys/stat.h>
+#endif
+
+namespace librevault {
+
+FileStat FileStat::read(const QString& abspath, bool preserve_symlinks) {
+	FileStat file_stat;
+#if defined(Q_OS_UNIX)
+	struct stat stat_buf; int stat_err = 0;
+	if(preserve_symlinks)
+		stat_err = lstat(QFile::encodeName(abspath), &stat_buf);
+	else
+		stat_err = stat(QFile::encodeName(abspath), &stat_buf);
+	if(stat_err == 0) {
+		file_stat.exists = true;
+#	if defined(Q_OS_MAC)
+		file_stat.mtime = (qint64)stat_buf.st_mtimespec.tv_sec * 1000000000 + stat_buf.st_mtimespec.tv_nsec;
+#	else
+		file_stat.mtime = (qint64)stat_buf.st_mtim.tv_sec * 1000000000 + stat_buf.st_mtim.tv_nsec;
+#	endif
+		file_stat.size = stat_buf.st_size;
+		file_stat.inode = stat_buf.st_ino;
+	}
+#else
+	QFileInfo file_info(abspath);
+	if(file_info.exists() || (preserve_symlinks && file_info.isSymLink())) {
+		file_stat.exists = true;
+		file_stat.mtime = file_info.lastModified().toMSecsSinceEpoch();
+		file_stat.size = file_info.size();
+	}
+#endif
+	return file_stat;
+}
+
+} /* namespace librevault */
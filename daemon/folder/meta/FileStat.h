@@ -0,0 +1,47 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QString>
+
+namespace librevault {
+
+/* FileStat is a cheap snapshot of file attributes. If it is not changed since the last indexing, the file is not reindexed. */
+struct FileStat {
+	bool exists = false;
+	qint64 mtime = 0;	// Nanoseconds on Unix, milliseconds elsewhere. Seconds are too coarse: a file can change twice within a second
+	qint64 size = 0;
+	quint64 inode = 0;
+
+	static FileStat read(const QString& abspath, bool preserve_symlinks);
+
+	bool operator==(const FileStat& b) const {return exists == b.exists && mtime == b.mtime && size == b.size && inode == b.inode;}
+	bool operator!=(const FileStat& b) const {return !(*this == b);}
+};
+
+} /* namespace librevault */
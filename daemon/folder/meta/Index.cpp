@@ -27,37 +27,57 @@
  * files in the program, then also delete it here.
  */
 #include "Index.h"
+#include "control/Config.h"
 #include "control/FolderParams.h"
 #include "control/StateCollector.h"
 #include "folder/meta/MetaStorage.h"
 #include "util/readable.h"
 #include <QFile>
+#include <QStringList>
+#include <QThread>
 
 namespace librevault {
 
 Index::Index(const FolderParams& params, StateCollector* state_collector, QObject* parent) : QObject(parent), params_(params), state_collector_(state_collector) {
-	auto db_filepath = params_.system_path + "/librevault.db";
+	db_filepath_ = params_.system_path + "/librevault.db";
+	read_connections_limit_ = std::max(1u, Config::get()->getGlobal("index_read_connections").toUInt());
 
-	if(QFile::exists(db_filepath))
-		LOGD("Opening SQLite3 DB:" << db_filepath);
+	if(QFile::exists(db_filepath_))
+		LOGD("Opening SQLite3 DB:" << db_filepath_);
 	else
-		LOGD("Creating new SQLite3 DB:" << db_filepath);
-	db_ = std::make_unique<SQLiteDB>(db_filepath.toStdString());
+		LOGD("Creating new SQLite3 DB:" << db_filepath_);
+	db_ = std::make_unique<SQLiteDB>(db_filepath_.toStdString());
+	db_->exec("PRAGMA journal_mode = WAL;");  // Readers don't block the writer and vice versa
+	setPragmas(db_.get());
 	db_->exec("PRAGMA foreign_keys = ON;");
 
 	/* TABLE meta */
-	db_->exec("CREATE TABLE IF NOT EXISTS meta (path_id BLOB PRIMARY KEY NOT NULL, meta BLOB NOT NULL, signature BLOB NOT NULL, type INTEGER NOT NULL, assembled BOOLEAN DEFAULT (0) NOT NULL);");
+	db_->exec("CREATE TABLE IF NOT EXISTS meta (path_id BLOB PRIMARY KEY NOT NULL, meta BLOB NOT NULL, signature BLOB NOT NULL, type INTEGER NOT NULL, assembled BOOLEAN DEFAULT (0) NOT NULL, bitfield BLOB);");
+	bool have_bitfield_column = false;
+	for(auto row : db_->exec("PRAGMA table_info(meta);"))
+		if(row[1].as_text() == "bitfield") have_bitfield_column = true;
+	if(!have_bitfield_column)
+		db_->exec("ALTER TABLE meta ADD COLUMN bitfield BLOB;");   // DB, created by older version
 	db_->exec("CREATE INDEX IF NOT EXISTS meta_type_idx ON meta (type);");   // For making "COUNT(*) ... WHERE type=x" way faster
 	db_->exec("CREATE INDEX IF NOT EXISTS meta_not_deleted_idx ON meta(type<>255);");   // For faster Index::getExistingMeta
 
 	/* TABLE chunk */
-	db_->exec("CREATE TABLE IF NOT EXISTS chunk (ct_hash BLOB NOT NULL PRIMARY KEY, size INTEGER NOT NULL, iv BLOB NOT NULL);");
+	db_->exec("CREATE TABLE IF NOT EXISTS chunk (ct_hash BLOB NOT NULL PRIMARY KEY, size INTEGER NOT NULL, iv BLOB NOT NULL, pt_hmac BLOB);");
+	bool have_pt_hmac_column = false;
+	for(auto row : db_->exec("PRAGMA table_info(chunk);"))
+		if(row[1].as_text() == "pt_hmac") have_pt_hmac_column = true;
 
 	/* TABLE openfs */
 	db_->exec("CREATE TABLE IF NOT EXISTS openfs (ct_hash BLOB NOT NULL REFERENCES chunk (ct_hash) ON DELETE CASCADE ON UPDATE CASCADE, path_id BLOB NOT NULL REFERENCES meta (path_id) ON DELETE CASCADE ON UPDATE CASCADE, [offset] INTEGER NOT NULL, assembled BOOLEAN DEFAULT (0) NOT NULL);");
 	db_->exec("CREATE INDEX IF NOT EXISTS openfs_assembled_idx ON openfs (ct_hash, assembled) WHERE assembled = 1;");    // For faster OpenStorage::have_chunk
 	db_->exec("CREATE INDEX IF NOT EXISTS openfs_path_id_fki ON openfs (path_id);");    // For faster AssemblerQueue::assemble_file
-	db_->exec("CREATE IF NOT EXISTS INDEX openfs_ct_hash_fki ON openfs (ct_hash);");    // For faster Index::containingChunk
+	db_->exec("CREATE INDEX IF NOT EXISTS openfs_ct_hash_fki ON openfs (ct_hash);");    // For faster Index::containingChunk
+	/* TABLE filestat */
+	db_->exec("CREATE TABLE IF NOT EXISTS filestat (path_id BLOB PRIMARY KEY NOT NULL, mtime INTEGER NOT NULL, size INTEGER NOT NULL, inode INTEGER NOT NULL);");  // For skipping unchanged files in DirectoryPoller
+
+	/* TABLE packed_chunk */
+	db_->exec("CREATE TABLE IF NOT EXISTS packed_chunk (ct_hash BLOB PRIMARY KEY NOT NULL, segment INTEGER NOT NULL, [offset] INTEGER NOT NULL, size INTEGER NOT NULL);");  // Chunk locations of PackEncStorage
+
 	//db_->exec("CREATE TRIGGER IF NOT EXISTS chunk_deleter AFTER DELETE ON openfs BEGIN DELETE FROM chunk WHERE ct_hash NOT IN (SELECT ct_hash FROM openfs); END;");   // Damn, there are more problems with this trigger than profit from it. Anyway, we can add it anytime later.
 
 	/* Create a special hash-file */
@@ -72,9 +92,89 @@ Index::Index(const FolderParams& params, StateCollector* state_collector, QObjec
 	hash_file.write(hexhash_conf);
 	hash_file.close();
 
+	if(!have_pt_hmac_column) {
+		// DB, created by older version. Filling pt_hmac from existing Metas
+		db_->exec("ALTER TABLE chunk ADD COLUMN pt_hmac BLOB;");
+		SQLiteSavepoint raii_transaction(*db_, "pt_hmac_migration");
+		forEachMeta([this](const SignedMeta& smeta){
+			for(auto& chunk : smeta.meta().chunks())
+				db_->exec_cached("UPDATE chunk SET pt_hmac=:pt_hmac WHERE ct_hash=:ct_hash;", {{":ct_hash", chunk.ct_hash}, {":pt_hmac", chunk.pt_hmac}});
+		});
+		raii_transaction.commit();
+	}
+	db_->exec("CREATE INDEX IF NOT EXISTS chunk_pt_hmac_idx ON chunk (pt_hmac);");   // For finding identical plaintext in local files
+
+	loadAssembledChunks();
+
+	commit_timer_ = new QTimer(this);
+	commit_timer_->setSingleShot(true);
+	commit_timer_->setInterval(Config::get()->getGlobal("index_commit_interval").toInt());
+	commit_batch_size_ = Config::get()->getGlobal("index_commit_batch").toInt();
+	connect(commit_timer_, &QTimer::timeout, this, &Index::commitMeta);
+
 	notifyState();
 }
 
+Index::~Index() {
+	if(batch_open_)
+		db_->exec("COMMIT");   // No signals here, receivers can be already destroyed
+}
+
+void Index::setPragmas(SQLiteDB* db) {
+	// Value is pasted into SQL, so only known modes are accepted
+	QString synchronous = Config::get()->getGlobal("index_synchronous").toString().toUpper();
+	if(!QStringList({"OFF", "NORMAL", "FULL", "EXTRA"}).contains(synchronous)) {
+		LOGW("Unknown index_synchronous mode:" << synchronous << "Using NORMAL");
+		synchronous = "NORMAL";
+	}
+	db->exec("PRAGMA synchronous = " + synchronous.toStdString() + ";");
+	db->exec("PRAGMA mmap_size = " + std::to_string(Config::get()->getGlobal("index_mmap_size").toLongLong()) + ";");
+	db->exec("PRAGMA cache_size = " + std::to_string(Config::get()->getGlobal("index_cache_size").toLongLong()) + ";");
+	db->exec("PRAGMA busy_timeout = 10000;");
+}
+
+Index::ReadConnection::ReadConnection(Index* index) : index_(index) {
+	if(QThread::currentThread() == index_->thread()) {
+		db_ = index_->db_.get();
+		return;
+	}
+
+	std::unique_lock<std::mutex> lk(index_->read_dbs_mtx_);
+	index_->read_dbs_cv_.wait(lk, [this]{return !index_->read_dbs_.empty() || index_->read_connections_open_ < index_->read_connections_limit_;});
+	if(!index_->read_dbs_.empty()) {
+		read_db_ = std::move(index_->read_dbs_.back());
+		index_->read_dbs_.pop_back();
+	}else{
+		index_->read_connections_open_++;
+		lk.unlock();
+		read_db_ = std::make_unique<SQLiteDB>(index_->db_filepath_.toStdString(), SQLITE_OPEN_READONLY);
+		index_->setPragmas(read_db_.get());
+	}
+	db_ = read_db_.get();
+}
+
+Index::ReadConnection::~ReadConnection() {
+	if(!read_db_) return;
+
+	std::unique_lock<std::mutex> lk(index_->read_dbs_mtx_);
+	index_->read_dbs_.push_back(std::move(read_db_));
+	index_->read_dbs_cv_.notify_one();
+}
+
+Index::WriteConnection::WriteConnection(Index* index) {
+	if(QThread::currentThread() == index->thread()) {
+		db_ = index->db_.get();
+		return;
+	}
+
+	lk_ = std::unique_lock<std::mutex>(index->external_write_db_mtx_);
+	if(!index->external_write_db_) {
+		index->external_write_db_ = std::make_unique<SQLiteDB>(index->db_filepath_.toStdString());
+		index->setPragmas(index->external_write_db_.get());	// busy_timeout covers the time, while the batch is open
+	}
+	db_ = index->external_write_db_.get();
+}
+
 bool Index::haveMeta(const Meta::PathRevision& path_revision) noexcept {
 	try {
 		getMeta(path_revision);
@@ -95,11 +195,21 @@ SignedMeta Index::getMeta(const Meta::PathRevision& path_revision) {
 
 void Index::putMeta(const SignedMeta& signed_meta, bool fully_assembled) {
 	LOGFUNC();
-	qsrand(time(nullptr));
-	QString transaction_name = QStringLiteral("put_Meta_%1").arg(qrand());
-	SQLiteSavepoint raii_transaction(*db_, transaction_name.toStdString()); // Begin transaction
+	if(!batch_open_) {
+		// Taking the write lock at once, so a commit from the external write connection can't invalidate the batch's snapshot
+		batch_open_ = db_->exec_cached("BEGIN IMMEDIATE").result_code() == SQLITE_DONE;
+		if(!batch_open_)
+			LOGW("Could not open index batch, Meta is committed on its own. E:" << sqlite3_errmsg(db_->sqlite3_handle()));
+	}
+	SQLiteSavepoint raii_transaction(*db_, "put_meta"); // Nested in batch, rolls back only this Meta on error
+
+	// Assembled chunks of the previous version of this Meta are removed with it
+	QList<QByteArray> assembled_removed, assembled_added;
+	for(auto row : db_->exec_cached("SELECT ct_hash FROM openfs WHERE path_id=:path_id AND assembled=1;", {{":path_id", signed_meta.meta().path_id()}}))
+		assembled_removed << conv_bytearray(row[0].as_blob());
+	db_->exec_cached("DELETE FROM openfs WHERE path_id=:path_id;", {{":path_id", signed_meta.meta().path_id()}});
 
-	db_->exec("INSERT OR REPLACE INTO meta (path_id, meta, signature, type, assembled) VALUES (:path_id, :meta, :signature, :type, :assembled);", {
+	db_->exec_cached("INSERT OR REPLACE INTO meta (path_id, meta, signature, type, assembled) VALUES (:path_id, :meta, :signature, :type, :assembled);", {
 			{":path_id", signed_meta.meta().path_id()},
 			{":meta", signed_meta.raw_meta()},
 			{":signature", signed_meta.signature()},
@@ -107,41 +217,97 @@ void Index::putMeta(const SignedMeta& signed_meta, bool fully_assembled) {
 			{":assembled", (uint64_t)fully_assembled}
 	});
 
+	// File stat is stored by IndexerQueue after the Meta is put
+	db_->exec_cached("DELETE FROM filestat WHERE path_id=:path_id;", {{":path_id", signed_meta.meta().path_id()}});
+
 	uint64_t offset = 0;
 	for(auto chunk : signed_meta.meta().chunks()){
-		db_->exec("INSERT OR IGNORE INTO chunk (ct_hash, size, iv) VALUES (:ct_hash, :size, :iv);", {
+		db_->exec_cached("INSERT OR IGNORE INTO chunk (ct_hash, size, iv, pt_hmac) VALUES (:ct_hash, :size, :iv, :pt_hmac);", {
 				{":ct_hash", chunk.ct_hash},
 				{":size", (uint64_t)chunk.size},
-				{":iv", chunk.iv}
+				{":iv", chunk.iv},
+				{":pt_hmac", chunk.pt_hmac}
 		});
 
-		db_->exec("INSERT OR REPLACE INTO openfs (ct_hash, path_id, [offset], assembled) VALUES (:ct_hash, :path_id, :offset, :assembled);", {
+		db_->exec_cached("INSERT OR REPLACE INTO openfs (ct_hash, path_id, [offset], assembled) VALUES (:ct_hash, :path_id, :offset, :assembled);", {
 				{":ct_hash", chunk.ct_hash},
 				{":path_id", signed_meta.meta().path_id()},
 				{":offset", (uint64_t)offset},
 				{":assembled", (uint64_t)fully_assembled}
 		});
+		if(fully_assembled)
+			assembled_added << conv_bytearray(chunk.ct_hash);
 
 		offset += chunk.size;
 	}
 
 	raii_transaction.commit();  // End transaction
+	updateAssembledChunks(assembled_added, assembled_removed);
 
 	if(fully_assembled)
 		LOGD("Added fully assembled Meta of " << path_id_readable(signed_meta.meta().path_id()) << " t:" << signed_meta.meta().meta_type());
 	else
 		LOGD("Added Meta of " << path_id_readable(signed_meta.meta().path_id()) << " t:" << signed_meta.meta().meta_type());
 
-	emit metaAdded(signed_meta);
-	if(!fully_assembled)
-		emit metaAddedExternal(signed_meta);
+	uncommitted_metas_ << qMakePair(signed_meta, fully_assembled);
+	if(!batch_open_ || uncommitted_metas_.size() >= commit_batch_size_)
+		commitMeta();
+	else if(!commit_timer_->isActive())
+		commit_timer_->start();
+}
+
+void Index::commitMeta() {
+	commit_timer_->stop();
+	if(!commitBatch() || uncommitted_metas_.isEmpty()) return;
+
+	LOGD("Committed " << uncommitted_metas_.size() << " Metas");
+
+	auto committed_metas = std::move(uncommitted_metas_);
+	uncommitted_metas_.clear();
+	for(auto& committed_meta : committed_metas) {
+		emit metaAdded(committed_meta.first);
+		if(!committed_meta.second)
+			emit metaAddedExternal(committed_meta.first);
+	}
 
 	notifyState();
 }
 
+void Index::flush() {
+	commitBatch();
+	if(!uncommitted_metas_.isEmpty() && !commit_timer_->isActive())
+		commit_timer_->start();	// Announced from the event loop
+}
+
+bool Index::commitBatch() {
+	if(!batch_open_) return true;
+
+	if(db_->exec_cached("COMMIT").result_code() == SQLITE_DONE) {
+		batch_open_ = false;
+		return true;
+	}
+
+	if(sqlite3_get_autocommit(db_->sqlite3_handle()) == 0) {
+		// Transaction is still open (e.g. SQLITE_BUSY), retrying later
+		LOGW("Could not commit index batch, retrying. E:" << sqlite3_errmsg(db_->sqlite3_handle()));
+		commit_timer_->start();
+		return false;
+	}
+
+	// Rolled back by SQLite. Metas of the batch are lost, their files are indexed again on next scan
+	LOGW("Index batch of" << uncommitted_metas_.size() << "Metas is rolled back. E:" << sqlite3_errmsg(db_->sqlite3_handle()));
+	batch_open_ = false;
+	for(auto& uncommitted_meta : uncommitted_metas_)
+		db_->exec_cached("DELETE FROM filestat WHERE path_id=:path_id;", {{":path_id", uncommitted_meta.first.meta().path_id()}});
+	uncommitted_metas_.clear();
+	loadAssembledChunks();
+	return false;
+}
+
 QList<SignedMeta> Index::getMeta(const std::string& sql, const std::map<std::string, SQLValue>& values){
 	QList<SignedMeta> result_list;
-	for(auto row : db_->exec(sql, values))
+	ReadConnection db(this);
+	for(auto row : db->exec_cached(sql, values))
 		result_list << SignedMeta(row[0], row[1], params_.secret);
 	return result_list;
 }
@@ -153,16 +319,46 @@ SignedMeta Index::getMeta(const blob& path_id){
 	if(meta_list.empty()) throw MetaStorage::no_such_meta();
 	return *meta_list.begin();
 }
-QList<SignedMeta> Index::getMeta(){
-	return getMeta("SELECT meta, signature FROM meta");
+void Index::forEachMeta(const std::function<void(const SignedMeta&)>& visitor) {
+	visitMeta("1", [&](const SignedMeta& smeta, const QByteArray&){visitor(smeta);});
+}
+
+void Index::forEachExistingMeta(const std::function<void(const SignedMeta&)>& visitor) {
+	visitMeta("(type<>255)=1 AND assembled=1", [&](const SignedMeta& smeta, const QByteArray&){visitor(smeta);});
+}
+
+void Index::forEachIncompleteMeta(const std::function<void(const SignedMeta&)>& visitor) {
+	visitMeta("(type<>255)=1 AND assembled=0", [&](const SignedMeta& smeta, const QByteArray&){visitor(smeta);});
 }
 
-QList<SignedMeta> Index::getExistingMeta() {
-	return getMeta("SELECT meta, signature FROM meta WHERE (type<>255)=1 AND assembled=1;");
+void Index::forEachMetaBitfield(const std::function<void(const SignedMeta&, const QByteArray&)>& visitor) {
+	visitMeta("1", visitor);
 }
 
-QList<SignedMeta> Index::getIncompleteMeta() {
-	return getMeta("SELECT meta, signature FROM meta WHERE (type<>255)=1 AND assembled=0;");
+void Index::visitMeta(const std::string& condition, const std::function<void(const SignedMeta&, const QByteArray&)>& visitor) {
+	const std::string first_page_sql = "SELECT path_id, meta, signature, bitfield FROM meta WHERE " + condition + " ORDER BY path_id LIMIT :limit;";
+	const std::string next_page_sql = "SELECT path_id, meta, signature, bitfield FROM meta WHERE path_id > :last_path_id AND " + condition + " ORDER BY path_id LIMIT :limit;";
+
+	blob last_path_id;
+	bool first_page = true;
+	QList<QPair<SignedMeta, QByteArray>> page;
+	do {
+		page.clear();
+		{
+			ReadConnection db(this);
+			std::map<std::string, SQLValue> values = {{":limit", (uint64_t)visit_page_size_}};
+			if(!first_page)
+				values.insert({":last_path_id", last_path_id});
+			for(auto row : db->exec_cached(first_page ? first_page_sql : next_page_sql, values)) {
+				last_path_id = row[0].as_blob();
+				page << qMakePair(SignedMeta(row[1], row[2], params_.secret), row[3].is_null() ? QByteArray() : conv_bytearray(row[3].as_blob()));
+			}
+		}
+		first_page = false;
+
+		for(auto& entry : page)
+			visitor(entry.first, entry.second);
+	}while(page.size() == visit_page_size_);
 }
 
 bool Index::putAllowed(const Meta::PathRevision& path_revision) noexcept {
@@ -174,35 +370,168 @@ bool Index::putAllowed(const Meta::PathRevision& path_revision) noexcept {
 }
 
 void Index::setAssembled(blob path_id) {
-	db_->exec("UPDATE meta SET assembled=1 WHERE path_id=:path_id", {{":path_id", path_id}});
-	db_->exec("UPDATE openfs SET assembled=1 WHERE path_id=:path_id", {{":path_id", path_id}});
+	WriteConnection db(this);
+	SQLiteSavepoint raii_transaction(*db, "set_assembled");
+
+	QList<QByteArray> assembled_added;
+	for(auto row : db->exec("SELECT ct_hash FROM openfs WHERE path_id=:path_id AND assembled=0", {{":path_id", path_id}}))
+		assembled_added << conv_bytearray(row[0].as_blob());
+
+	if(db->exec("UPDATE meta SET assembled=1 WHERE path_id=:path_id", {{":path_id", path_id}}).result_code() != SQLITE_DONE
+		|| db->exec("UPDATE openfs SET assembled=1 WHERE path_id=:path_id", {{":path_id", path_id}}).result_code() != SQLITE_DONE) {
+		LOGW("Could not mark Meta as assembled. E:" << sqlite3_errmsg(db->sqlite3_handle()));
+		return;
+	}
+	raii_transaction.commit();
+	updateAssembledChunks(assembled_added, {});
 }
 
-bool Index::isAssembledChunk(blob ct_hash) {
-	auto sql_result = db_->exec("SELECT assembled FROM openfs WHERE ct_hash=:ct_hash AND openfs.assembled=1 LIMIT 1", {
-		{":ct_hash", ct_hash}
+void Index::putBitfield(const blob& path_id, const QByteArray& bitfield) {
+	WriteConnection db(this);
+	auto result = db->exec_cached("UPDATE meta SET bitfield=:bitfield WHERE path_id=:path_id;", {
+		{":path_id", path_id},
+		{":bitfield", conv_bytearray(bitfield)}
 	});
-	return sql_result.have_rows();
+	if(result.result_code() != SQLITE_DONE)
+		LOGW("Could not store bitfield. E:" << sqlite3_errmsg(db->sqlite3_handle()));	// Stored bitfield is only a cache
+}
+
+QByteArray Index::getBitfield(const blob& path_id) {
+	ReadConnection db(this);
+	for(auto row : db->exec_cached("SELECT bitfield FROM meta WHERE path_id=:path_id;", {{":path_id", path_id}}))
+		return row[0].is_null() ? QByteArray() : conv_bytearray(row[0].as_blob());
+	return QByteArray();
+}
+
+bool Index::isAssembledChunk(blob ct_hash) {
+	std::unique_lock<std::mutex> lk(assembled_chunks_mtx_);
+	return assembled_chunks_.contains(conv_bytearray(ct_hash));
+}
+
+void Index::loadAssembledChunks() {
+	std::unique_lock<std::mutex> lk(assembled_chunks_mtx_);
+	assembled_chunks_.clear();
+	for(auto row : db_->exec("SELECT ct_hash, COUNT(*) FROM openfs WHERE assembled=1 GROUP BY ct_hash"))
+		assembled_chunks_.insert(conv_bytearray(row[0].as_blob()), (int)row[1].as_int());
+}
+
+void Index::updateAssembledChunks(const QList<QByteArray>& added, const QList<QByteArray>& removed) {
+	std::unique_lock<std::mutex> lk(assembled_chunks_mtx_);
+	for(auto& ct_hash : added)
+		assembled_chunks_[ct_hash]++;
+	for(auto& ct_hash : removed) {
+		auto it = assembled_chunks_.find(ct_hash);
+		if(it != assembled_chunks_.end() && --(*it) <= 0)
+			assembled_chunks_.erase(it);
+	}
 }
 
 QPair<quint32, QByteArray> Index::getChunkSizeIv(blob ct_hash) {
-	for(auto row : db_->exec("SELECT size, iv FROM chunk WHERE ct_hash=:ct_hash", {{":ct_hash", ct_hash}})) {
+	ReadConnection db(this);
+	for(auto row : db->exec_cached("SELECT size, iv FROM chunk WHERE ct_hash=:ct_hash", {{":ct_hash", ct_hash}})) {
 		return qMakePair(row[0].as_uint(), conv_bytearray(row[1].as_blob()));
 	}
 	throw MetaStorage::no_such_meta();
 };
 
+void Index::putFileStat(const blob& path_id, const FileStat& file_stat) {
+	WriteConnection db(this);
+	int result_code;
+	if(!file_stat.exists)
+		result_code = db->exec("DELETE FROM filestat WHERE path_id=:path_id;", {{":path_id", path_id}}).result_code();
+	else
+		result_code = db->exec_cached("INSERT OR REPLACE INTO filestat (path_id, mtime, size, inode) VALUES (:path_id, :mtime, :size, :inode);", {
+			{":path_id", path_id},
+			{":mtime", (int64_t)file_stat.mtime},
+			{":size", (int64_t)file_stat.size},
+			{":inode", (uint64_t)file_stat.inode}
+		}).result_code();
+	if(result_code != SQLITE_DONE)
+		LOGW("Could not store file stat. E:" << sqlite3_errmsg(db->sqlite3_handle()));	// File is indexed again on next scan
+}
+
+QHash<QByteArray, FileStat> Index::getFileStats(const QList<blob>& path_ids) {
+	QHash<QByteArray, FileStat> file_stats;
+	if(path_ids.isEmpty()) return file_stats;
+
+	// Single query for the whole batch
+	std::string sql = "SELECT path_id, mtime, size, inode FROM filestat WHERE path_id IN (";
+	std::map<std::string, SQLValue> values;
+	for(int i = 0; i < path_ids.size(); i++) {
+		std::string param_name = ":p" + std::to_string(i);
+		sql += (i == 0 ? "" : ", ") + param_name;
+		values.insert({param_name, path_ids[i]});
+	}
+	sql += ");";
+
+	ReadConnection db(this);
+	for(auto row : db->exec(sql, values)) {
+		FileStat file_stat;
+		file_stat.exists = true;
+		file_stat.mtime = row[1].as_int();
+		file_stat.size = row[2].as_int();
+		file_stat.inode = row[3].as_uint();
+		file_stats.insert(conv_bytearray(row[0].as_blob()), file_stat);
+	}
+	return file_stats;
+}
+
+void Index::putPackedChunks(const QList<PackedChunk>& packed_chunks) {
+	WriteConnection db(this);
+	SQLiteSavepoint raii_transaction(*db, "put_packed_chunks");
+	for(auto& packed_chunk : packed_chunks) {
+		auto result = db->exec_cached("INSERT OR REPLACE INTO packed_chunk (ct_hash, segment, [offset], size) VALUES (:ct_hash, :segment, :offset, :size);", {
+			{":ct_hash", conv_bytearray(packed_chunk.ct_hash)},
+			{":segment", (uint64_t)packed_chunk.segment},
+			{":offset", (uint64_t)packed_chunk.offset},
+			{":size", (uint64_t)packed_chunk.size}
+		});
+		if(result.result_code() != SQLITE_DONE)
+			throw std::runtime_error("Could not store packed chunk location: " + std::string(sqlite3_errmsg(db->sqlite3_handle())));
+	}
+	raii_transaction.commit();
+}
+
+void Index::removePackedChunk(const blob& ct_hash) {
+	WriteConnection db(this);
+	auto result = db->exec_cached("DELETE FROM packed_chunk WHERE ct_hash=:ct_hash;", {{":ct_hash", ct_hash}});
+	if(result.result_code() != SQLITE_DONE)
+		throw std::runtime_error("Could not remove packed chunk location: " + std::string(sqlite3_errmsg(db->sqlite3_handle())));
+}
+
+QList<PackedChunk> Index::getPackedChunks() {
+	QList<PackedChunk> packed_chunks;
+	ReadConnection db(this);
+	for(auto row : db->exec("SELECT ct_hash, segment, [offset], size FROM packed_chunk")) {
+		PackedChunk packed_chunk;
+		packed_chunk.ct_hash = conv_bytearray(row[0].as_blob());
+		packed_chunk.segment = (quint32)row[1].as_uint();
+		packed_chunk.offset = row[2].as_uint();
+		packed_chunk.size = (quint32)row[3].as_uint();
+		packed_chunks << packed_chunk;
+	}
+	return packed_chunks;
+}
+
 QList<SignedMeta> Index::containingChunk(const blob& ct_hash) {
 	return getMeta("SELECT meta.meta, meta.signature FROM meta JOIN openfs ON meta.path_id=openfs.path_id WHERE openfs.ct_hash=:ct_hash",
 		{{":ct_hash", ct_hash}});
 }
 
+QList<SignedMeta> Index::containingAssembledPlaintext(const blob& pt_hmac) {
+	return getMeta("SELECT DISTINCT meta.meta, meta.signature FROM chunk JOIN openfs ON chunk.ct_hash=openfs.ct_hash JOIN meta ON meta.path_id=openfs.path_id WHERE chunk.pt_hmac=:pt_hmac AND openfs.assembled=1",
+		{{":pt_hmac", pt_hmac}});
+}
+
 void Index::wipe() {
 	SQLiteSavepoint savepoint(*db_, "Index::wipe");
 	db_->exec("DELETE FROM meta");
 	db_->exec("DELETE FROM chunk");
 	db_->exec("DELETE FROM openfs");
+	db_->exec("DELETE FROM filestat");
+	db_->exec("DELETE FROM packed_chunk");
 	savepoint.commit();
+	loadAssembledChunks();
 	db_->exec("VACUUM");
 }
 
@@ -27,11 +27,18 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "FileStat.h"
+#include "PackedChunk.h"
 #include "blob.h"
 #include "util/log.h"
 #include "util/SQLiteWrapper.h"
 #include <librevault/SignedMeta.h>
+#include <QHash>
 #include <QObject>
+#include <QTimer>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 
 namespace librevault {
 
@@ -47,15 +54,19 @@ signals:
 
 public:
 	Index(const FolderParams& params, StateCollector* state_collector, QObject* parent);
+	virtual ~Index();
 
 	/* Meta manipulators */
 	bool haveMeta(const Meta::PathRevision& path_revision) noexcept;
 	SignedMeta getMeta(const Meta::PathRevision& path_revision);
 	SignedMeta getMeta(const blob& path_id);
-	QList<SignedMeta> getMeta();
-	QList<SignedMeta> getExistingMeta();
-	QList<SignedMeta> getIncompleteMeta();
+	void forEachMeta(const std::function<void(const SignedMeta&)>& visitor);
+	void forEachExistingMeta(const std::function<void(const SignedMeta&)>& visitor);
+	void forEachIncompleteMeta(const std::function<void(const SignedMeta&)>& visitor);
+	void forEachMetaBitfield(const std::function<void(const SignedMeta&, const QByteArray&)>& visitor);
 	void putMeta(const SignedMeta& signed_meta, bool fully_assembled = false);
+	void commitMeta();
+	void flush();	// Commits the open batch, but its Metas are announced later, by commitMeta(). Call before waiting for threads, which write into index
 
 	bool putAllowed(const Meta::PathRevision& path_revision) noexcept;
 
@@ -63,8 +74,22 @@ public:
 	bool isAssembledChunk(blob ct_hash);
 	QPair<quint32, QByteArray> getChunkSizeIv(blob ct_hash);
 
+	/* Stored bitfields. Bitfield is reset, when a new revision of Meta is put */
+	void putBitfield(const blob& path_id, const QByteArray& bitfield);
+	QByteArray getBitfield(const blob& path_id);
+
+	/* File stats of indexed files */
+	void putFileStat(const blob& path_id, const FileStat& file_stat);
+	QHash<QByteArray, FileStat> getFileStats(const QList<blob>& path_ids);
+
+	/* Chunk locations of PackEncStorage. Writes throw on failure, so the caller doesn't lose track of stored data */
+	void putPackedChunks(const QList<PackedChunk>& packed_chunks);
+	void removePackedChunk(const blob& ct_hash);
+	QList<PackedChunk> getPackedChunks();
+
 	/* Properties */
 	QList<SignedMeta> containingChunk(const blob& ct_hash);
+	QList<SignedMeta> containingAssembledPlaintext(const blob& pt_hmac);
 
 private:
 	const FolderParams& params_;
@@ -72,7 +97,61 @@ private:
 
 	std::unique_ptr<SQLiteDB> db_;	// Better use SOCI library ( https://github.com/SOCI/soci ). My "reinvented wheel" isn't stable enough.
 
+	/* Read connections. Reads from other threads (assembler, uploader, indexer) go there and see only committed data, but they don't wait for the writer.
+	 * Reads from Index's own thread use db_, so they see uncommitted Metas of the current batch. */
+	QString db_filepath_;
+	unsigned read_connections_limit_;
+	unsigned read_connections_open_ = 0;
+	std::vector<std::unique_ptr<SQLiteDB>> read_dbs_;	// Idle read connections
+	std::mutex read_dbs_mtx_;
+	std::condition_variable read_dbs_cv_;
+
+	class ReadConnection {
+	public:
+		ReadConnection(Index* index);
+		~ReadConnection();
+		SQLiteDB* operator->() {return db_;}
+	private:
+		Index* index_;
+		std::unique_ptr<SQLiteDB> read_db_;
+		SQLiteDB* db_;
+	};
+	void setPragmas(SQLiteDB* db);
+
+	/* Write connection. Writes from Index's own thread go to db_ and join the current batch.
+	 * Writes from other threads use a separate connection, so they are committed on their own and are not rolled back or delayed with the batch. */
+	std::unique_ptr<SQLiteDB> external_write_db_;
+	std::mutex external_write_db_mtx_;
+
+	class WriteConnection {
+	public:
+		WriteConnection(Index* index);
+		SQLiteDB* operator->() {return db_;}
+		SQLiteDB& operator*() {return *db_;}
+	private:
+		std::unique_lock<std::mutex> lk_;
+		SQLiteDB* db_;
+	};
+
+	/* Number of assembled openfs entries for every ct_hash. isAssembledChunk is called for every chunk on bitfield generation, so it must not touch DB */
+	QHash<QByteArray, int> assembled_chunks_;
+	std::mutex assembled_chunks_mtx_;
+	void loadAssembledChunks();
+	void updateAssembledChunks(const QList<QByteArray>& added, const QList<QByteArray>& removed);
+
+	/* Group commit. Metas are put into one open transaction, which is committed after a timeout or when the batch is large enough.
+	 * Reads are done on the same connection, so they see uncommitted Metas. Signals are emitted after commit. */
+	QTimer* commit_timer_;
+	int commit_batch_size_;
+	bool batch_open_ = false;
+	QList<QPair<SignedMeta, bool>> uncommitted_metas_;	// Put, but not announced yet
+	bool commitBatch();	// Returns false, if the batch is still open or was rolled back
+
 	QList<SignedMeta> getMeta(const std::string& sql, const std::map<std::string, SQLValue>& values = std::map<std::string, SQLValue>());
+
+	/* Visits Metas page by page, ordered by path_id. No statement is open while visitor runs, so it can use Index */
+	const int visit_page_size_ = 256;
+	void visitMeta(const std::string& condition, const std::function<void(const SignedMeta&, const QByteArray&)>& visitor);
 	void wipe();
 
 	void notifyState();
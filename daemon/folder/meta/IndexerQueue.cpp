@@ -29,15 +29,39 @@
 #include "IndexerQueue.h"
 #include "IndexerWorker.h"
 #include "MetaStorage.h"
+#include "control/Config.h"
 #include "control/FolderParams.h"
 #include "control/StateCollector.h"
 #include "folder/IgnoreList.h"
 #include "folder/PathNormalizer.h"
+#include <QFileInfo>
+#include <QStorageInfo>
+#include <QThread>
 
 Q_LOGGING_CATEGORY(log_indexer, "folder.meta.indexer")
 
 namespace librevault {
 
+/* IndexerDiskThrottle */
+bool IndexerDiskThrottle::tryAcquire(const QByteArray& disk_id) {
+	QMutexLocker lk(&running_mtx_);
+
+	if(running_.value(disk_id) >= Config::get()->getGlobal("indexer_disk_threads").toInt())
+		return false;
+	running_[disk_id]++;
+	return true;
+}
+
+void IndexerDiskThrottle::release(const QByteArray& disk_id) {
+	{
+		QMutexLocker lk(&running_mtx_);
+		if(--running_[disk_id] <= 0)
+			running_.remove(disk_id);
+	}
+	emit released();
+}
+
+/* IndexerQueue */
 IndexerQueue::IndexerQueue(const FolderParams& params, IgnoreList* ignore_list, PathNormalizer* path_normalizer, StateCollector* state_collector, QObject* parent) :
 	QObject(parent),
 	params_(params),
@@ -52,51 +76,147 @@ IndexerQueue::IndexerQueue(const FolderParams& params, IgnoreList* ignore_list,
 	connect(this, &IndexerQueue::startedIndexing, this, [this]{state_collector_->folder_state_set(conv_bytearray(secret_.get_Hash()), "is_indexing", true);});
 	connect(this, &IndexerQueue::finishedIndexing, this, [this]{state_collector_->folder_state_set(conv_bytearray(secret_.get_Hash()), "is_indexing", false);});
 
+	max_running_ = params_.index_threads > 0 ? int(params_.index_threads) : QThread::idealThreadCount();
 	threadpool_ = new QThreadPool(this);
+	threadpool_->setMaxThreadCount(max_running_);
+
+	// Chunks of a single file are hashed and encrypted in parallel. Limit the number of chunks in memory.
+	chunk_threadpool_ = new QThreadPool(this);
+	chunk_slots_.release(chunk_threadpool_->maxThreadCount()*2);
+
+	// Files on the same disk share the disk throttle with other folders
+	disk_id_ = QStorageInfo(params_.path).device();
+	if(disk_id_.isEmpty())
+		disk_id_ = params_.path.toUtf8();
+	connect(IndexerDiskThrottle::get_instance(), &IndexerDiskThrottle::released, this, &IndexerQueue::scheduleTasks, Qt::QueuedConnection);
 }
 
 IndexerQueue::~IndexerQueue() {
 	qCDebug(log_indexer) << "~IndexerQueue";
+	pending_.clear();
+	pending_keys_.clear();
 	emit aboutToStop();
+	meta_storage_->flush();	// Index batch holds the write lock, workers could wait for it
 	threadpool_->waitForDone();
+	chunk_threadpool_->waitForDone();
+	for(int i = 0; i < running_.size(); i++)
+		IndexerDiskThrottle::get_instance()->release(disk_id_);
 	qCDebug(log_indexer) << "!~IndexerQueue";
 }
 
 void IndexerQueue::addIndexing(QString abspath) {
-	if(tasks_.contains(abspath)) {
-		IndexerWorker* worker = tasks_.value(abspath);
-		threadpool_->cancel(worker);
-		worker->stop();
+	if(IndexerWorker* worker = running_.value(abspath))
+		worker->stop(); // It will be restarted after it stops
+
+	enqueue(abspath, Priority::INTERACTIVE);
+	scheduleTasks();
+}
+
+void IndexerQueue::addRescanIndexing(QStringList abspaths) {
+	rescan_requested_ = false;
+
+	foreach(const QString& abspath, abspaths) {
+		if(!running_.contains(abspath))
+			enqueue(abspath, Priority::RESCAN);
 	}
-	IndexerWorker* worker = new IndexerWorker(abspath, params_, meta_storage_, ignore_list_, path_normalizer_, this);
+	scheduleTasks();
+}
+
+void IndexerQueue::requestRescanPaths() {
+	rescan_requested_ = false;
+	scheduleTasks();
+}
+
+void IndexerQueue::enqueue(QString abspath, Priority priority) {
+	auto key_it = pending_keys_.find(abspath);
+	if(key_it != pending_keys_.end()) {
+		if(key_it->priority <= priority)
+			return; // Already queued with the same, or higher priority
+
+		// Promote to interactive
+		pending_.erase(*key_it);
+		pending_keys_.erase(key_it);
+		rescan_pending_--;
+	}
+
+	bool was_idle = pending_.empty() && running_.empty();
+
+	TaskKey key{priority, QFileInfo(abspath).size(), next_seq_++};
+	pending_.insert({key, abspath});
+	pending_keys_.insert(abspath, key);
+	if(priority == Priority::RESCAN)
+		rescan_pending_++;
+
+	if(was_idle)
+		emit startedIndexing();
+}
+
+void IndexerQueue::scheduleTasks() {
+	for(auto task_it = pending_.begin(); task_it != pending_.end() && running_.size() < max_running_;) {
+		QString abspath = task_it->second;
+		Priority priority = task_it->first.priority;
+
+		// Keep one thread for interactive changes, so they don't wait for large files of a rescan
+		if(priority == Priority::RESCAN && max_running_ > 1 && running_.size() >= max_running_-1)
+			break;
+
+		// Previous indexing of this path is being stopped
+		if(running_.contains(abspath)) {
+			++task_it;
+			continue;
+		}
+
+		if(!IndexerDiskThrottle::get_instance()->tryAcquire(disk_id_))
+			break;
+
+		task_it = pending_.erase(task_it);
+		pending_keys_.remove(abspath);
+		if(priority == Priority::RESCAN)
+			rescan_pending_--;
+
+		startTask(abspath);
+	}
+
+	if(!rescan_requested_ && rescan_pending_ < rescan_queue_limit_/2) {
+		rescan_requested_ = true;
+		emit rescanQueueStarving(rescan_queue_limit_ - rescan_pending_);
+	}
+}
+
+void IndexerQueue::startTask(QString abspath) {
+	IndexerWorker* worker = new IndexerWorker(abspath, params_, meta_storage_, ignore_list_, path_normalizer_, chunk_threadpool_, &chunk_slots_, this);
 	worker->setAutoDelete(false);
 	connect(this, &IndexerQueue::aboutToStop, worker, &IndexerWorker::stop, Qt::DirectConnection);
 	connect(worker, &IndexerWorker::metaCreated, this, &IndexerQueue::metaCreated);
 	connect(worker, &IndexerWorker::metaFailed, this, &IndexerQueue::metaFailed);
-	tasks_.insert(abspath, worker);
-	if(tasks_.size() == 1)
-		emit startedIndexing();
+	running_.insert(abspath, worker);
 	threadpool_->start(worker);
 }
 
-void IndexerQueue::metaCreated(SignedMeta smeta) {
-	IndexerWorker* worker = qobject_cast<IndexerWorker*>(sender());
-	tasks_.remove(worker->absolutePath());
+void IndexerQueue::finishTask(IndexerWorker* worker) {
+	if(running_.value(worker->absolutePath()) == worker)
+		running_.remove(worker->absolutePath());
 	worker->deleteLater();
+	IndexerDiskThrottle::get_instance()->release(disk_id_);
 
-	if(tasks_.size() == 0)
+	if(pending_.empty() && running_.empty())
 		emit finishedIndexing();
 
+	scheduleTasks();
+}
+
+void IndexerQueue::metaCreated(SignedMeta smeta) {
+	IndexerWorker* worker = qobject_cast<IndexerWorker*>(sender());
+	finishTask(worker);
+
 	meta_storage_->putMeta(smeta, true);
+	if(smeta.meta().meta_type() != Meta::DELETED)
+		meta_storage_->putFileStat(smeta.meta().path_id(), worker->fileStat());
 }
 
 void IndexerQueue::metaFailed(QString error_string) {
 	IndexerWorker* worker = qobject_cast<IndexerWorker*>(sender());
-	tasks_.remove(worker->absolutePath());
-	worker->deleteLater();
-
-	if(tasks_.size() == 0)
-		emit finishedIndexing();
+	finishTask(worker);
 
 	qCWarning(log_indexer) << "Skipping" << worker->absolutePath() << "Reason:" << error_string;
 }
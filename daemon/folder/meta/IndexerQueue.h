@@ -28,9 +28,14 @@
  */
 #pragma once
 #include <librevault/SignedMeta.h>
-#include <QMap>
+#include <QHash>
+#include <QMutex>
+#include <QSemaphore>
 #include <QString>
+#include <QStringList>
 #include <QThreadPool>
+#include <map>
+#include <tuple>
 
 namespace librevault {
 
@@ -40,6 +45,29 @@ class IgnoreList;
 class PathNormalizer;
 class StateCollector;
 class IndexerWorker;
+
+/* IndexerDiskThrottle is a singleton class, used to limit the number of files, being indexed from the same disk at once, across all folders */
+class IndexerDiskThrottle : public QObject {
+	Q_OBJECT
+signals:
+	void released();
+
+public:
+	static IndexerDiskThrottle* get_instance() {
+		static IndexerDiskThrottle* instance;
+		if(!instance)
+			instance = new IndexerDiskThrottle();
+		return instance;
+	}
+
+	bool tryAcquire(const QByteArray& disk_id);
+	void release(const QByteArray& disk_id);
+
+private:
+	QMutex running_mtx_;
+	QHash<QByteArray, int> running_;
+};
+
 class IndexerQueue : public QObject {
 	Q_OBJECT
 signals:
@@ -48,12 +76,16 @@ signals:
 	void startedIndexing();
 	void finishedIndexing();
 
+	void rescanQueueStarving(int free_slots);
+
 public:
 	IndexerQueue(const FolderParams& params, IgnoreList* ignore_list, PathNormalizer* path_normalizer, StateCollector* state_collector, QObject* parent);
 	virtual ~IndexerQueue();
 
 public slots:
-	void addIndexing(QString abspath);
+	void addIndexing(QString abspath);  // Interactive changes. Indexed before everything else.
+	void addRescanIndexing(QStringList abspaths);  // Paths from periodic rescans. Only a limited number of them is queued at once.
+	void requestRescanPaths();
 
 private:
 	const FolderParams& params_;
@@ -63,10 +95,39 @@ private:
 	StateCollector* state_collector_;
 
 	QThreadPool* threadpool_;
+	QThreadPool* chunk_threadpool_;
+	QSemaphore chunk_slots_;
 
 	const Secret& secret_;
 
-	QMap<QString, IndexerWorker*> tasks_;
+	/* Scheduling */
+	enum class Priority : unsigned {
+		INTERACTIVE = 0,
+		RESCAN = 1
+	};
+	struct TaskKey {
+		Priority priority;
+		qint64 size;
+		quint64 seq;
+
+		bool operator<(const TaskKey& b) const {return std::tie(priority, size, seq) < std::tie(b.priority, b.size, b.seq);}
+	};
+	std::map<TaskKey, QString> pending_;    // Ordered by priority, then smaller files go first
+	QHash<QString, TaskKey> pending_keys_;
+	QHash<QString, IndexerWorker*> running_;
+	quint64 next_seq_ = 0;
+
+	int max_running_;
+	QByteArray disk_id_;
+
+	const int rescan_queue_limit_ = 1024;
+	int rescan_pending_ = 0;
+	bool rescan_requested_ = false;
+
+	void enqueue(QString abspath, Priority priority);
+	void scheduleTasks();
+	void startTask(QString abspath);
+	void finishTask(IndexerWorker* worker);
 
 private slots:
 	void metaCreated(SignedMeta smeta);
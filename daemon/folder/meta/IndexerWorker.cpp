@@ -29,15 +29,17 @@
 #include "IndexerWorker.h"
 
 #include "MetaStorage.h"
+#include "RabinChunker.h"
 #include "control/FolderParams.h"
 #include "folder/IgnoreList.h"
 #include "folder/PathNormalizer.h"
 #include "human_size.h"
 #include <librevault/crypto/HMAC-SHA3.h>
 #include <librevault/crypto/AES_CBC.h>
-#include <rabin.h>
 #include <boost/filesystem.hpp>
 #include <QFile>
+#include <deque>
+#include <future>
 #ifdef Q_OS_UNIX
 #   include <sys/stat.h>
 #endif
@@ -49,13 +51,26 @@ Q_DECLARE_LOGGING_CATEGORY(log_indexer)
 
 namespace librevault {
 
-IndexerWorker::IndexerWorker(QString abspath, const FolderParams& params, MetaStorage* meta_storage, IgnoreList* ignore_list, PathNormalizer* path_normalizer, QObject* parent) :
+/* ChunkTask runs IndexerWorker::populate_chunk or IndexerWorker::verify_old_chunk on a chunk thread pool */
+template<class Result>
+class ChunkTask : public QRunnable {
+public:
+	ChunkTask(std::packaged_task<Result()> task) : task_(std::move(task)) {}
+	void run() override {task_();}
+
+private:
+	std::packaged_task<Result()> task_;
+};
+
+IndexerWorker::IndexerWorker(QString abspath, const FolderParams& params, MetaStorage* meta_storage, IgnoreList* ignore_list, PathNormalizer* path_normalizer, QThreadPool* chunk_pool, QSemaphore* chunk_slots, QObject* parent) :
 	QObject(parent),
 	abspath_(abspath),
 	params_(params),
 	meta_storage_(meta_storage),
 	ignore_list_(ignore_list),
 	path_normalizer_(path_normalizer),
+	chunk_pool_(chunk_pool),
+	chunk_slots_(chunk_slots),
 	secret_(params.secret),
 	active_(true) {}
 
@@ -68,10 +83,13 @@ void IndexerWorker::run() noexcept {
 	try {
 		if(ignore_list_->isIgnored(normpath)) throw abort_index("File is ignored");
 
+		file_stat_ = FileStat::read(abspath_, params_.preserve_symlinks);
+
 		try {
 			old_smeta_ = meta_storage_->getMeta(Meta::make_path_id(normpath.toStdString(), secret_));
 			old_meta_ = old_smeta_.meta();
 			if(boost::filesystem::last_write_time(abspath_.toStdString()) == old_meta_.mtime()) {
+				meta_storage_->putFileStat(old_meta_.path_id(), file_stat_);
 				throw abort_index("Modification time is not changed");
 			}
 		}catch(boost::filesystem::filesystem_error& e){
@@ -110,8 +128,10 @@ void IndexerWorker::make_Meta() {
 	if(!old_smeta_ && new_meta_.meta_type() == Meta::DELETED)
 		throw abort_index("Old Meta is not in the index, new Meta is DELETED");
 
-	if(old_meta_.meta_type() == Meta::DIRECTORY && new_meta_.meta_type() == Meta::DIRECTORY)
+	if(old_meta_.meta_type() == Meta::DIRECTORY && new_meta_.meta_type() == Meta::DIRECTORY) {
+		meta_storage_->putFileStat(new_meta_.path_id(), file_stat_);
 		throw abort_index("Old Meta is DIRECTORY, new Meta is DIRECTORY");
+	}
 
 	if(old_meta_.meta_type() == Meta::DELETED && new_meta_.meta_type() == Meta::DELETED)
 		throw abort_index("Old Meta is DELETED, new Meta is DELETED");
@@ -229,34 +249,175 @@ void IndexerWorker::update_chunks() {
 	// Chunking
 	std::vector<Meta::Chunk> chunks;
 
-	blob buffer;
-	buffer.reserve(hasher.maxsize);
-
 	QFile f(abspath_);
 	if(!f.open(QIODevice::ReadOnly))
 		throw abort_index("I/O error: " + f.errorString());
 
-	char byte;
-	while(f.getChar(&byte) && active_) {
-		buffer.push_back(byte);
-		//size_t len = fread(buf, 1, sizeof(buf), stdin);
-		uint8_t *ptr = &buffer.back();
+	// Incremental mode: chunks of the old Meta, that are still in place, are reused without chunking and encryption.
+	// Rabin hasher is reset on every chunk boundary, so chunking, restarted from an old boundary gives the same result.
+	std::map<quint64, size_t> old_boundaries;  // offset -> index of old chunk
+	std::vector<quint64> old_offsets;  // index of old chunk -> offset
+	if(old_meta_.meta_type() == Meta::FILE && old_meta_.validate()) {
+		quint64 offset = 0;
+		for(size_t chunk_idx = 0; chunk_idx < old_meta_.chunks().size(); chunk_idx++) {
+			old_boundaries.insert({offset, chunk_idx});
+			old_offsets.push_back(offset);
+			offset += old_meta_.chunks().at(chunk_idx).size;
+		}
+	}
+
+	// Chunks are found here, but hashed and encrypted on chunk_pool_. Results are collected in order.
+	std::deque<std::future<Meta::Chunk>> pending_chunks;
+	auto collect_chunk = [&]{
+		std::future<Meta::Chunk> chunk_future = std::move(pending_chunks.front());
+		pending_chunks.pop_front();
+		chunk_slots_->release();
+		chunks.push_back(chunk_future.get());
+	};
+	auto acquire_slot = [&]{
+		// Never block on a free slot while holding our own: other workers may be waiting for them.
+		while(!chunk_slots_->tryAcquire()) {
+			if(!pending_chunks.empty())
+				collect_chunk();
+			else {
+				chunk_slots_->acquire();
+				break;
+			}
+		}
+	};
+
+	// Old chunks are verified on chunk_pool_ a few chunks ahead of the chunker. But the chunker waits for the verification of a boundary
+	// before moving past it: a changed chunk is chunked by Rabin from its start, so chunking lands on old boundaries again after an insertion or deletion.
+	struct OldChunkCheck {
+		size_t chunk_idx;
+		std::future<bool> unchanged;
+	};
+	std::deque<OldChunkCheck> old_chunk_checks;  // Consecutive old chunks, starting at the current offset. Every check holds a chunk slot
+	const size_t check_ahead = std::max(1, chunk_pool_->maxThreadCount());
+	auto start_check = [&](size_t chunk_idx) {
+		const Meta::Chunk& old_chunk = old_meta_.chunks().at(chunk_idx);
+		quint64 offset = old_offsets.at(chunk_idx);
+		std::packaged_task<bool()> task([this, old_chunk, offset]{
+			return verify_old_chunk(offset, old_chunk);
+		});
+		old_chunk_checks.push_back({chunk_idx, task.get_future()});
+		chunk_pool_->start(new ChunkTask<bool>(std::move(task)));
+	};
+	auto can_reuse = [&](size_t chunk_idx) {
+		const Meta::Chunk& old_chunk = old_meta_.chunks().at(chunk_idx);
+		quint64 end_offset = old_offsets.at(chunk_idx) + old_chunk.size;
+		quint64 file_size = f.size();
+		if(end_offset > file_size) return false;
+		if(chunk_idx == old_meta_.chunks().size()-1 && end_offset != file_size) return false;  // It was cut by the end of file, not by Rabin
+		return true;
+	};
+	auto drop_checks = [&]{
+		// Tasks reference this, so they must finish before we leave
+		for(auto& check : old_chunk_checks) {
+			check.unchanged.wait();
+			chunk_slots_->release();
+		}
+		old_chunk_checks.clear();
+	};
+	auto reuse_chunk = [&](quint64 offset) -> quint32 {   // Returns size of reused chunk, or 0
+		if(old_chunk_checks.empty()) {
+			auto boundary_it = old_boundaries.find(offset);
+			if(boundary_it == old_boundaries.end() || !can_reuse(boundary_it->second)) return 0;
+
+			acquire_slot();
+			start_check(boundary_it->second);
+		}
+		while(old_chunk_checks.size() < check_ahead) {
+			size_t next_idx = old_chunk_checks.back().chunk_idx + 1;
+			if(next_idx >= old_meta_.chunks().size() || !can_reuse(next_idx) || !chunk_slots_->tryAcquire()) break;
+			start_check(next_idx);
+		}
+
+		OldChunkCheck check = std::move(old_chunk_checks.front());
+		old_chunk_checks.pop_front();
+		bool unchanged = false;
+		try {
+			unchanged = check.unchanged.get();
+		}catch(...) {
+			chunk_slots_->release();
+			throw;
+		}
+		if(!unchanged) {
+			chunk_slots_->release();
+			drop_checks();	// Checks ahead are useless now. Rabin decides, where the next chunks start
+			return 0;
+		}
+
+		// Slot of the check is passed to the reused chunk
+		const Meta::Chunk& old_chunk = old_meta_.chunks().at(check.chunk_idx);
+		std::promise<Meta::Chunk> reused_chunk;
+		reused_chunk.set_value(old_chunk);
+		pending_chunks.push_back(reused_chunk.get_future());
+		return old_chunk.size;
+	};
 
-		if(rabin_next_chunk(&hasher, ptr, 1) == 1) {    // Found a chunk
-			chunks.push_back(populate_chunk(buffer, pt_hmac__iv));
-			buffer.clear();
+	try {
+		RabinChunker chunker(&f, hasher);
+		RabinChunker::Span chunk_span;
+		quint64 offset = 0;
+		size_t reused_chunks = 0;
+		bool chunker_positioned = true;
+
+		while(active_) {
+			if(quint32 reused_size = reuse_chunk(offset)) {
+				offset += reused_size;
+				reused_chunks++;
+				chunker_positioned = false;
+				continue;
+			}
+
+			// Changed or new data. Chunk it until we reach one of the old boundaries again.
+			if(!chunker_positioned) {
+				chunker.seek(offset);
+				chunker_positioned = true;
+			}
+			if(!chunker.next(chunk_span)) break;
+			offset = chunker.offset();
+
+			acquire_slot();
+			std::packaged_task<Meta::Chunk()> task([this, &pt_hmac__iv, data = chunk_span.to_blob()]{
+				return populate_chunk(data, pt_hmac__iv);
+			});
+			pending_chunks.push_back(task.get_future());
+			chunk_pool_->start(new ChunkTask<Meta::Chunk>(std::move(task)));
 		}
+
+		drop_checks();
+		while(!pending_chunks.empty())
+			collect_chunk();
+
+		if(reused_chunks)
+			qCDebug(log_indexer) << "Reused" << reused_chunks << "unchanged chunks of" << abspath_;
+	}catch(...) {
+		// Tasks reference pt_hmac__iv and this, so they must finish before we leave
+		drop_checks();
+		for(auto& chunk_future : pending_chunks) {
+			chunk_future.wait();
+			chunk_slots_->release();
+		}
+		throw;
 	}
 
 	if(!active_)
 		throw abort_index("Indexing had been interruped");
 
-	if(rabin_finalize(&hasher) != 0)
-		chunks.push_back(populate_chunk(buffer, pt_hmac__iv));
-
 	new_meta_.set_chunks(chunks);
 }
 
+bool IndexerWorker::verify_old_chunk(quint64 offset, const Meta::Chunk& old_chunk) {
+	QFile f(abspath_);	// Own handle, checks run in parallel
+	blob data(old_chunk.size);
+	if(!f.open(QIODevice::ReadOnly) || !f.seek(offset) || f.read(reinterpret_cast<char*>(data.data()), data.size()) != qint64(data.size()))
+		throw abort_index("I/O error: " + f.errorString());
+
+	return (data | crypto::HMAC_SHA3_224(secret_.get_Encryption_Key())) == old_chunk.pt_hmac;
+}
+
 Meta::Chunk IndexerWorker::populate_chunk(const blob& data, const std::map<blob, blob>& pt_hmac__iv) {
 	qCDebug(log_indexer) << "New chunk size:" << data.size();
 	Meta::Chunk chunk;
@@ -27,12 +27,15 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "FileStat.h"
 #include "blob.h"
 #include <librevault/SignedMeta.h>
 #include <QLoggingCategory>
 #include <QObject>
 #include <QRunnable>
+#include <QSemaphore>
 #include <QString>
+#include <QThreadPool>
 #include <map>
 
 namespace librevault {
@@ -52,10 +55,11 @@ public:
 		abort_index(QString what) : std::runtime_error(what.toStdString()) {}
 	};
 
-	IndexerWorker(QString abspath, const FolderParams& params, MetaStorage* meta_storage, IgnoreList* ignore_list, PathNormalizer* path_normalizer, QObject* parent);
+	IndexerWorker(QString abspath, const FolderParams& params, MetaStorage* meta_storage, IgnoreList* ignore_list, PathNormalizer* path_normalizer, QThreadPool* chunk_pool, QSemaphore* chunk_slots, QObject* parent);
 	virtual ~IndexerWorker();
 
 	QString absolutePath() const {return abspath_;}
+	FileStat fileStat() const {return file_stat_;}
 
 public slots:
 	void run() noexcept override;
@@ -68,8 +72,13 @@ private:
 	IgnoreList* ignore_list_;
 	PathNormalizer* path_normalizer_;
 
+	QThreadPool* chunk_pool_;
+	QSemaphore* chunk_slots_;  // Limits the number of chunks, being hashed at once by all workers
+
 	const Secret& secret_;
 
+	FileStat file_stat_;  // Taken before indexing, so changes made during indexing cause a rescan
+
 	Meta old_meta_, new_meta_;
 	SignedMeta old_smeta_, new_smeta_;
 
@@ -83,6 +92,7 @@ private:
 	void update_fsattrib();
 	void update_chunks();
 	Meta::Chunk populate_chunk(const blob& data, const std::map<blob, blob>& pt_hmac__iv);
+	bool verify_old_chunk(quint64 offset, const Meta::Chunk& old_chunk);	// True, if plaintext of the old chunk is not changed
 };
 
 } /* namespace librevault */
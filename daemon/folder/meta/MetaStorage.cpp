@@ -43,7 +43,9 @@ MetaStorage::MetaStorage(const FolderParams& params, IgnoreList* ignore_list, Pa
 	watcher_ = new DirectoryWatcher(params, ignore_list, path_normalizer, this);
 
 	if(params.secret.get_type() <= Secret::Type::ReadWrite){
-		connect(poller_, &DirectoryPoller::newPath, indexer_, &IndexerQueue::addIndexing);
+		connect(poller_, &DirectoryPoller::rescanStarted, indexer_, &IndexerQueue::requestRescanPaths);
+		connect(poller_, &DirectoryPoller::newPaths, indexer_, &IndexerQueue::addRescanIndexing);
+		connect(indexer_, &IndexerQueue::rescanQueueStarving, poller_, &DirectoryPoller::feedPaths, Qt::QueuedConnection);
 		connect(watcher_, &DirectoryWatcher::newPath, indexer_, &IndexerQueue::addIndexing);
 
 		poller_->setEnabled(true);
@@ -53,7 +55,12 @@ MetaStorage::MetaStorage(const FolderParams& params, IgnoreList* ignore_list, Pa
 	connect(index_, &Index::metaAddedExternal, this, &MetaStorage::metaAddedExternal);
 };
 
-MetaStorage::~MetaStorage() {}
+MetaStorage::~MetaStorage() {
+	// Index is the first child, so it would be destroyed before threads, which use it, are stopped
+	delete watcher_;
+	delete poller_;
+	delete indexer_;
+}
 
 bool MetaStorage::haveMeta(const Meta::PathRevision& path_revision) noexcept {
 	return index_->haveMeta(path_revision);
@@ -67,26 +74,34 @@ SignedMeta MetaStorage::getMeta(const blob& path_id) {
 	return index_->getMeta(path_id);
 }
 
-QList<SignedMeta> MetaStorage::getMeta() {
-	return index_->getMeta();
+void MetaStorage::forEachMeta(const MetaVisitor& visitor) {
+	index_->forEachMeta(visitor);
 }
 
-QList<SignedMeta> MetaStorage::getExistingMeta() {
-	return index_->getExistingMeta();
+void MetaStorage::forEachExistingMeta(const MetaVisitor& visitor) {
+	index_->forEachExistingMeta(visitor);
 }
 
-QList<SignedMeta> MetaStorage::getIncompleteMeta() {
-	return index_->getIncompleteMeta();
+void MetaStorage::forEachIncompleteMeta(const MetaVisitor& visitor) {
+	index_->forEachIncompleteMeta(visitor);
 }
 
 void MetaStorage::putMeta(const SignedMeta& signed_meta, bool fully_assembled) {
 	return index_->putMeta(signed_meta, fully_assembled);
 }
 
+void MetaStorage::flush() {
+	index_->flush();
+}
+
 QList<SignedMeta> MetaStorage::containingChunk(const blob& ct_hash) {
 	return index_->containingChunk(ct_hash);
 }
 
+QList<SignedMeta> MetaStorage::containingAssembledPlaintext(const blob& pt_hmac) {
+	return index_->containingAssembledPlaintext(pt_hmac);
+}
+
 void MetaStorage::markAssembled(blob path_id) {
 	index_->setAssembled(path_id);
 }
@@ -95,6 +110,38 @@ bool MetaStorage::isChunkAssembled(blob ct_hash) {
 	return index_->isAssembledChunk(ct_hash);
 }
 
+void MetaStorage::forEachMetaBitfield(const std::function<void(const SignedMeta&, const QByteArray&)>& visitor) {
+	index_->forEachMetaBitfield(visitor);
+}
+
+void MetaStorage::putBitfield(const blob& path_id, const QByteArray& bitfield) {
+	index_->putBitfield(path_id, bitfield);
+}
+
+QByteArray MetaStorage::getBitfield(const blob& path_id) {
+	return index_->getBitfield(path_id);
+}
+
+void MetaStorage::putFileStat(const blob& path_id, const FileStat& file_stat) {
+	index_->putFileStat(path_id, file_stat);
+}
+
+QHash<QByteArray, FileStat> MetaStorage::getFileStats(const QList<blob>& path_ids) {
+	return index_->getFileStats(path_ids);
+}
+
+void MetaStorage::putPackedChunks(const QList<PackedChunk>& packed_chunks) {
+	index_->putPackedChunks(packed_chunks);
+}
+
+void MetaStorage::removePackedChunk(const blob& ct_hash) {
+	index_->removePackedChunk(ct_hash);
+}
+
+QList<PackedChunk> MetaStorage::getPackedChunks() {
+	return index_->getPackedChunks();
+}
+
 QPair<quint32, QByteArray> MetaStorage::getChunkSizeIv(blob ct_hash) {
 	return index_->getChunkSizeIv(ct_hash);
 };
@@ -27,9 +27,13 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "FileStat.h"
+#include "PackedChunk.h"
 #include "blob.h"
 #include <librevault/SignedMeta.h>
+#include <QHash>
 #include <QObject>
+#include <functional>
 
 namespace librevault {
 
@@ -53,23 +57,41 @@ public:
 		no_such_meta() : std::runtime_error("Requested Meta not found"){}
 	};
 
+	using MetaVisitor = std::function<void(const SignedMeta&)>;
+
 	MetaStorage(const FolderParams& params, IgnoreList* ignore_list, PathNormalizer* path_normalizer, StateCollector* state_collector, QObject* parent);
 	virtual ~MetaStorage();
 
 	bool haveMeta(const Meta::PathRevision& path_revision) noexcept;
 	SignedMeta getMeta(const Meta::PathRevision& path_revision);
 	SignedMeta getMeta(const blob& path_id);
-	QList<SignedMeta> getMeta();
-	QList<SignedMeta> getExistingMeta();
-	QList<SignedMeta> getIncompleteMeta();
+	void forEachMeta(const MetaVisitor& visitor);
+	void forEachExistingMeta(const MetaVisitor& visitor);
+	void forEachIncompleteMeta(const MetaVisitor& visitor);
+	void forEachMetaBitfield(const std::function<void(const SignedMeta&, const QByteArray&)>& visitor);	// Visitor gets stored bitfield, or null QByteArray
 	void putMeta(const SignedMeta& signed_meta, bool fully_assembled = false);
+	void flush();	// Commits Metas, which are put, but not committed yet
 	QList<SignedMeta> containingChunk(const blob& ct_hash);
+	QList<SignedMeta> containingAssembledPlaintext(const blob& pt_hmac);	// Assembled Metas, containing a chunk with this plaintext (ct_hash can differ)
 	QPair<quint32, QByteArray> getChunkSizeIv(blob ct_hash);
 
+	// Stored bitfields
+	void putBitfield(const blob& path_id, const QByteArray& bitfield);
+	QByteArray getBitfield(const blob& path_id);
+
 	// Assembled index
 	void markAssembled(blob path_id);
 	bool isChunkAssembled(blob ct_hash);
 
+	// File stats of indexed files
+	void putFileStat(const blob& path_id, const FileStat& file_stat);
+	QHash<QByteArray, FileStat> getFileStats(const QList<blob>& path_ids);
+
+	// Chunk locations of PackEncStorage
+	void putPackedChunks(const QList<PackedChunk>& packed_chunks);
+	void removePackedChunk(const blob& ct_hash);
+	QList<PackedChunk> getPackedChunks();
+
 	bool putAllowed(const Meta::PathRevision& path_revision) noexcept;
 
 	void prepareAssemble(QByteArray normpath, Meta::Type type, bool with_removal = false);
@@ -0,0 +1,101 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "RabinChunker.h"
+#include <cstring>
+
+namespace librevault {
+
+RabinChunker::RabinChunker(QFile* file, const rabin_t& hasher, size_t read_size) :
+	file_(file),
+	initial_hasher_(hasher),
+	hasher_(hasher),
+	read_size_(read_size),
+	buffer_(hasher.maxsize + read_size) {}   // Unfinished chunk is always shorter than maxsize, so there is always room for a whole read
+
+bool RabinChunker::next(Span& chunk) {
+	while(true) {
+		if(scanned_ == end_) {
+			if(eof_) {
+				if(begin_ == end_ || rabin_finalize(&hasher_) == 0)
+					return false;
+
+				// Last chunk, cut by the end of file
+				chunk = Span{buffer_.data()+begin_, end_-begin_};
+				offset_ += chunk.size;
+				begin_ = end_;
+				return true;
+			}
+			refill();
+			continue;
+		}
+
+		int consumed = rabin_next_chunk(&hasher_, buffer_.data()+scanned_, unsigned(end_-scanned_));
+		if(consumed < 0) {
+			scanned_ = end_;
+			continue;
+		}
+
+		// Found a chunk
+		scanned_ += consumed;
+		chunk = Span{buffer_.data()+begin_, scanned_-begin_};
+		offset_ += chunk.size;
+		begin_ = scanned_;
+		return true;
+	}
+}
+
+void RabinChunker::seek(quint64 offset) {
+	if(!file_->seek(offset))
+		throw read_error(file_->errorString());
+
+	// Hasher state after a chunk boundary is the same, as the initial one
+	hasher_ = initial_hasher_;
+	begin_ = scanned_ = end_ = 0;
+	eof_ = false;
+	offset_ = offset;
+}
+
+void RabinChunker::refill() {
+	// Move the unfinished chunk to the beginning of the buffer
+	if(buffer_.size() - end_ < read_size_) {
+		std::memmove(buffer_.data(), buffer_.data()+begin_, end_-begin_);
+		scanned_ -= begin_;
+		end_ -= begin_;
+		begin_ = 0;
+	}
+
+	qint64 bytes_read = file_->read(reinterpret_cast<char*>(buffer_.data()+end_), qint64(buffer_.size()-end_));
+	if(bytes_read < 0)
+		throw read_error(file_->errorString());
+	if(bytes_read == 0)
+		eof_ = true;
+	end_ += bytes_read;
+}
+
+} /* namespace librevault */
@@ -0,0 +1,81 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "blob.h"
+#include <rabin.h>
+#include <QFile>
+#include <stdexcept>
+
+namespace librevault {
+
+/* RabinChunker splits a file into content-defined chunks. The file is read through a single large buffer, so that
+ * Rabin fingerprint is computed over whole windows and found chunks are handed out as spans into this buffer,
+ * without copying every byte separately. */
+class RabinChunker {
+public:
+	struct read_error : public std::runtime_error {
+		read_error(QString what) : std::runtime_error(("I/O error: " + what).toStdString()) {}
+	};
+
+	struct Span {
+		const uint8_t* data;
+		size_t size;
+
+		blob to_blob() const {return blob(data, data+size);}
+	};
+
+	RabinChunker(QFile* file, const rabin_t& hasher, size_t read_size = 1024*1024);
+
+	/* Returns false, when the end of file is reached. Returned span is valid until the next call. */
+	bool next(Span& chunk);
+
+	/* Restarts chunking from offset. Must be a chunk boundary, found earlier with the same parameters. */
+	void seek(quint64 offset);
+
+	/* Offset of the next chunk in file */
+	quint64 offset() const {return offset_;}
+
+private:
+	QFile* file_;
+	const rabin_t initial_hasher_;
+	rabin_t hasher_;
+	const size_t read_size_;
+
+	blob buffer_;
+	size_t begin_ = 0;      // Start of the current (not yet found) chunk in buffer
+	size_t scanned_ = 0;    // End of the data, which is already fed into hasher
+	size_t end_ = 0;        // End of the valid data in buffer
+	bool eof_ = false;
+
+	quint64 offset_ = 0;
+
+	void refill();
+};
+
+} /* namespace librevault */
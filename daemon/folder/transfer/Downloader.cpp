@@ -34,12 +34,14 @@
 #include "util/readable.h"
 #include <QLoggingCategory>
 #include <boost/range/adaptor/map.hpp>
+#include <cmath>
+#include <limits>
 
 namespace librevault {
 
 Q_LOGGING_CATEGORY(log_downloader, "folder.downloader")
 
-DownloadChunk::DownloadChunk(const FolderParams& params, QByteArray ct_hash, quint32 size) : builder(params.system_path, ct_hash, size), ct_hash(ct_hash) {}
+DownloadChunk::DownloadChunk(const FolderParams& params, ChunkFileArena* arena, QByteArray ct_hash, quint32 size, Meta::StrongHashType strong_hash_type) : builder(arena, params.system_path, ct_hash, size, strong_hash_type), ct_hash(ct_hash) {}
 
 AvailabilityMap<uint32_t> DownloadChunk::requestMap() {
 	AvailabilityMap<uint32_t> request_map = builder.file_map();
@@ -51,11 +53,13 @@ AvailabilityMap<uint32_t> DownloadChunk::requestMap() {
 Downloader::Downloader(const FolderParams& params, MetaStorage* meta_storage, QObject* parent) :
 	QObject(parent),
 	params_(params),
-	meta_storage_(meta_storage) {
+	meta_storage_(meta_storage),
+	arena_(params.system_path) {
 	LOGFUNC();
 	maintain_timer_ = new QTimer(this);
 	connect(maintain_timer_, &QTimer::timeout, this, &Downloader::maintainRequests);
-	maintain_timer_->setInterval(Config::get()->getGlobal("p2p_request_timeout").toInt()*1000);
+	connect(maintain_timer_, &QTimer::timeout, this, &Downloader::maintainEndgame);
+	maintain_timer_->setInterval(1000);    // Expiry is cheap, so stalled requests are released soon after their timeout
 	maintain_timer_->setTimerType(Qt::VeryCoarseTimer);
 	maintain_timer_->start();
 }
@@ -83,32 +87,44 @@ void Downloader::notifyLocalMeta(const SignedMeta& smeta, const bitfield_type& b
 			removeChunk(ct_hash); // Do not mark connected chunks as clustered, because they will be marked inside the loop below.
 		}else{
 			have_incomplete = true; // We haven't this chunk, we need to download it
-			addChunk(ct_hash, meta_chunk.size);
+			addChunk(ct_hash, meta_chunk.size, smeta.meta().strong_hash_type());
 			incomplete_chunks << ct_hash;
 		}
 	}
 
 	if(have_complete && have_incomplete) {
 		foreach(QByteArray ct_hash, getMetaCluster(incomplete_chunks)) {
-			download_queue_.markClustered(ct_hash);
+			markClustered(ct_hash);
 		}
 	}
 }
 
-void Downloader::addChunk(QByteArray ct_hash, quint32 size) {
+void Downloader::addChunk(QByteArray ct_hash, quint32 size, Meta::StrongHashType strong_hash_type) {
 	qCDebug(log_downloader) << "Added" << ct_hash_readable(ct_hash) << "to download queue";
 
-	uint32_t padded_size = size % 16 == 0 ? size : ((size / 16) + 1) * 16;
+	if(down_chunks_.contains(ct_hash)) return;    // Keeping downloaded blocks and requests
 
-	DownloadChunkPtr chunk = std::make_shared<DownloadChunk>(params_, ct_hash, padded_size);
-	down_chunks_.insert(ct_hash, chunk);
+	uint32_t padded_size = size % 16 == 0 ? size : ((size / 16) + 1) * 16;
 
-	download_queue_.addChunk(ct_hash);
+	DownloadChunkPtr chunk = std::make_shared<DownloadChunk>(params_, &arena_, ct_hash, padded_size, strong_hash_type);
+	down_chunks_.insert(ct_hash, chunk);	// Queued, when some remote owns it
 }
 
 void Downloader::removeChunk(QByteArray ct_hash) {
-	if(down_chunks_.contains(ct_hash)) {
-		download_queue_.removeChunk(ct_hash);
+	if(DownloadChunkPtr chunk = down_chunks_.value(ct_hash)) {
+		for(auto request_it = chunk->requests.begin(); request_it != chunk->requests.end(); ++request_it)
+			request_it.key()->cancel_block(conv_bytearray(ct_hash), request_it->offset, request_it->size);
+		foreach(RemoteFolder* remote, chunk->requests.uniqueKeys())
+			removeRequests(chunk, remote);
+		foreach(RemoteFolder* owner_remote, chunk->owned_by.keys()) {
+			auto remote_chunks_it = remote_chunks_.find(owner_remote);
+			if(remote_chunks_it != remote_chunks_.end())
+				remote_chunks_it->remove(ct_hash);
+			auto queue_it = remote_queues_.find(owner_remote);
+			if(queue_it != remote_queues_.end())
+				queue_it->removeChunk(ct_hash);
+		}
+
 		down_chunks_.remove(ct_hash);
 
 		qCDebug(log_downloader) << "Removed" << ct_hash_readable(ct_hash) << "from download queue";
@@ -122,10 +138,52 @@ void Downloader::notifyLocalChunk(const blob& ct_hash) {
 
 	// Mark all other chunks "clustered"
 	foreach(QByteArray cluster_hash, getCluster(conv_bytearray(ct_hash))) {
-		download_queue_.markClustered(cluster_hash);
+		markClustered(cluster_hash);
 	}
 }
 
+void Downloader::notifyChunkNotStored(QByteArray ct_hash) {
+	DownloadChunkPtr chunk = down_chunks_.value(ct_hash);
+	if(! chunk) return;
+
+	qCWarning(log_downloader) << "Downloaded chunk" << ct_hash_readable(ct_hash) << "could not be stored, downloading again";
+	chunk->builder.reset();
+	updateRequestable(chunk);
+	QTimer::singleShot(0, this, &Downloader::maintainRequests);
+}
+
+void Downloader::markClustered(const QByteArray& ct_hash) {
+	DownloadChunkPtr chunk = down_chunks_.value(ct_hash);
+	if(! chunk || chunk->clustered) return;
+
+	chunk->clustered = true;
+	requeue(chunk);
+}
+
+void Downloader::requeue(DownloadChunkPtr chunk) {
+	foreach(RemoteFolder* owner_remote, chunk->owned_by.keys()) {
+		auto queue_it = remote_queues_.find(owner_remote);
+		if(queue_it == remote_queues_.end()) continue;
+
+		if(! chunk->requestable) {
+			queue_it->removeChunk(chunk->ct_hash);
+			continue;
+		}
+		queue_it->addChunk(chunk->ct_hash);
+		queue_it->setRemotesCount(chunk->ct_hash, chunk->owned_by.size());
+		if(chunk->clustered)
+			queue_it->markClustered(chunk->ct_hash);
+	}
+}
+
+void Downloader::updateRequestable(DownloadChunkPtr chunk) {
+	bool requestable = !chunk->requestMap().full();
+	if(requestable == chunk->requestable) return;
+
+	chunk->requestable = requestable;
+	requeue(chunk);
+}
+
 QSet<QByteArray> Downloader::getCluster(QByteArray ct_hash) {
 	QSet<QByteArray> cluster;
 
@@ -171,7 +229,8 @@ void Downloader::notifyRemoteChunk(RemoteFolder* remote, const blob& ct_hash) {
 		return;
 
 	chunk->owned_by.insert(remote, remote->get_interest_guard());
-	download_queue_.setRemotesCount(ct_hash_q, chunk->owned_by.size());
+	remote_chunks_[remote].insert(ct_hash_q);
+	requeue(chunk);
 
 	QTimer::singleShot(0, this, &Downloader::maintainRequests);
 }
@@ -180,8 +239,9 @@ void Downloader::handleChoke(RemoteFolder* remote) {
 	SCOPELOG(log_downloader);
 
 	/* Remove requests to this node */
-	foreach(DownloadChunkPtr missing_chunk, down_chunks_)
-		missing_chunk->requests.remove(remote);
+	foreach(const QByteArray& ct_hash, remote_requests_.value(remote))
+		if(DownloadChunkPtr missing_chunk = down_chunks_.value(ct_hash))
+			removeRequests(missing_chunk, remote);
 
 	QTimer::singleShot(0, this, &Downloader::maintainRequests);
 }
@@ -197,6 +257,8 @@ void Downloader::putBlock(const blob& ct_hash, uint32_t offset, const blob& data
 	if(! missing_chunk) return;
 
 	QList<QPair<QByteArray, QFile*>> downloaded_chunks;
+	bool received = false;
+	QList<QPair<QByteArray, QByteArray>> downloaded_chunks_in_memory;
 
 	QMutableHashIterator<RemoteFolder*, DownloadChunk::BlockRequest> request_it(missing_chunk->requests);
 	while(request_it.hasNext()) {
@@ -205,28 +267,51 @@ void Downloader::putBlock(const blob& ct_hash, uint32_t offset, const blob& data
 		if(request_it.value().offset == offset      // Chunk position incorrect
 		&& request_it.value().size == data.size()   // Chunk size incorrect
 		&& request_it.key() == from) {              // Requested node != replied. Well, it isn't critical, but will be useful to ban "fake" peers
+			received = true;
+			updatePipeline(from, std::chrono::steady_clock::now() - request_it.value().started, data.size());
 			request_it.remove();
+			requestsRemoved(missing_chunk, from, 1);
 
 			missing_chunk->builder.put_block(offset, QByteArray::fromRawData((const char*)data.data(), data.size()));
 			if(missing_chunk->builder.complete()) {
-				QFile* chunk_f = missing_chunk->builder.release_chunk();
-				chunk_f->setParent(this);
-
-				downloaded_chunks << qMakePair(conv_bytearray(ct_hash), chunk_f);
+				if(missing_chunk->builder.in_memory()) {
+					QByteArray chunk_ct = missing_chunk->builder.release_chunk_data();
+					if(!chunk_ct.isNull())
+						downloaded_chunks_in_memory << qMakePair(conv_bytearray(ct_hash), chunk_ct);
+				}else if(QFile* chunk_f = missing_chunk->builder.release_chunk()) {
+					chunk_f->setParent(this);
+					downloaded_chunks << qMakePair(conv_bytearray(ct_hash), chunk_f);
+				}
 			}   // TODO: catch "invalid hash" exception here
 		}
 	}
 
+	// The same block could be requested from other remotes in endgame
+	if(received)
+		cancelDuplicates(missing_chunk, offset, data.size());
+	updateRequestable(missing_chunk);
+
 	for(QPair<QByteArray, QFile*> chunk : downloaded_chunks) {
 		emit chunkDownloaded(chunk.first, chunk.second);
 	}
+	for(QPair<QByteArray, QByteArray> chunk : downloaded_chunks_in_memory) {
+		emit chunkDownloadedInMemory(chunk.first, chunk.second);
+	}
 
 	QTimer::singleShot(0, this, &Downloader::maintainRequests);
 }
 
 void Downloader::trackRemote(RemoteFolder* remote) {
 	remotes_.insert(remote);
-	download_queue_.setRemotesCount(remotes_.size());
+
+	Pipeline pipeline;
+	pipeline.window = Config::get()->getGlobal("p2p_download_slots").toUInt();
+	pipeline.sample_started = std::chrono::steady_clock::now();
+	pipelines_.insert(remote, pipeline);
+
+	remote_queues_.insert(remote, WeightedChunkQueue());
+	for(auto& queue : remote_queues_)
+		queue.setRemotesCount(remotes_.size());
 }
 
 void Downloader::untrackRemote(RemoteFolder* remote) {
@@ -234,65 +319,144 @@ void Downloader::untrackRemote(RemoteFolder* remote) {
 
 	if(! remotes_.contains(remote)) return;
 
-	foreach(DownloadChunkPtr missing_chunk, down_chunks_.values()) {
-		missing_chunk->requests.remove(remote);
-		missing_chunk->owned_by.remove(remote);
-		download_queue_.setRemotesCount(missing_chunk->ct_hash, missing_chunk->owned_by.size());
+	remote_queues_.remove(remote);
+	foreach(const QByteArray& ct_hash, remote_requests_.value(remote))
+		if(DownloadChunkPtr missing_chunk = down_chunks_.value(ct_hash))
+			removeRequests(missing_chunk, remote);
+	remote_requests_.remove(remote);
+
+	foreach(const QByteArray& ct_hash, remote_chunks_.take(remote)) {
+		if(DownloadChunkPtr missing_chunk = down_chunks_.value(ct_hash)) {
+			missing_chunk->owned_by.remove(remote);
+			requeue(missing_chunk);
+		}
 	}
 	remotes_.remove(remote);
-	download_queue_.setRemotesCount(remotes_.size());
+	pipelines_.remove(remote);
+	for(auto& queue : remote_queues_)
+		queue.setRemotesCount(remotes_.size());
 }
 
 void Downloader::maintainRequests() {
 	SCOPELOG(log_downloader);
 
 	// Prune old requests by timeout
-	{
-		auto request_timeout = std::chrono::seconds(Config::get()->getGlobal("p2p_request_timeout").toUInt());
-		foreach(DownloadChunkPtr missing_chunk, down_chunks_.values()) {
-			QMutableHashIterator<RemoteFolder*, DownloadChunk::BlockRequest> request_it(missing_chunk->requests);
-			while(request_it.hasNext()) {
-				if(request_it.next().value().started + request_timeout < std::chrono::steady_clock::now())
-					request_it.remove();
-			}
+	expireRequests();
+
+	// Make new requests, until windows of all remotes are full
+	while(requestOne());
+}
+
+bool Downloader::requestOne() {
+	SCOPELOG(log_downloader);
+
+	// Every remote with free window offers the head of its queue. The heaviest of them is requested
+	QByteArray ct_hash;
+	float best_weight = 0;
+	for(auto queue_it = remote_queues_.begin(); queue_it != remote_queues_.end(); ++queue_it) {
+		QByteArray head;
+		if(! canRequest(queue_it.key()) || ! queue_it->top(head)) continue;
+
+		float weight = queue_it->weight(head);
+		if(ct_hash.isNull() || weight > best_weight) {
+			ct_hash = head;
+			best_weight = weight;
 		}
 	}
+	if(ct_hash.isNull()) return false;
+
+	DownloadChunkPtr chunk = down_chunks_.value(ct_hash);
+	RemoteFolder* remote = nodeForRequest(ct_hash);	// Not null, at least the remote, which offered this chunk, can request it
+	if(! chunk || ! remote) return false;
+
+	// Rebuild request map to determine, which block to download now.
+	AvailabilityMap<uint32_t> request_map = chunk->requestMap();
 
-	// Make new requests
-	{
-		for(size_t i = countRequests(); i < Config::get()->getGlobal("p2p_download_slots").toUInt(); i++) {
-			bool requested = requestOne();
-			if(!requested) break;
+	// Request, actually. Several blocks of the chunk are pipelined to the same remote, as long as its window allows
+	uint32_t block_size = Config::get()->getGlobal("p2p_block_size").toUInt();
+	for(auto& missing_range : request_map) {
+		for(uint32_t offset = missing_range.first; offset < missing_range.first + missing_range.second && canRequest(remote); offset += block_size) {
+			DownloadChunk::BlockRequest request;
+			request.offset = offset;
+			request.size = std::min(missing_range.first + missing_range.second - offset, block_size);
+			request.started = std::chrono::steady_clock::now();
+
+			remote->request_block(conv_bytearray(ct_hash), request.offset, request.size);
+			addRequest(chunk, remote, request);
 		}
 	}
+
+	// Fully requested chunk leaves the queues, so the next call gets another one
+	updateRequestable(chunk);
+	return true;
 }
 
-bool Downloader::requestOne() {
+void Downloader::maintainEndgame() {
+	// The last blocks are requested from other owners too, so the tail is not bound to the slowest one
+	if(inEndgame())
+		requestEndgame();
+}
+
+bool Downloader::inEndgame() const {
+	// Remote queues hold chunks with unrequested blocks only
+	QByteArray head;
+	for(auto& queue : remote_queues_)
+		if(queue.top(head))
+			return false;
+	return requests_in_flight_ > 0;
+}
+
+bool Downloader::requestEndgame() {
 	SCOPELOG(log_downloader);
-	// Try to choose chunk to request
-	foreach(QByteArray ct_hash, download_queue_.chunks()) {
-		// Try to choose a remote to request this block from
-		auto remote = nodeForRequest(ct_hash);
-		if(! remote) continue;
+	bool requested = false;
+	auto now = std::chrono::steady_clock::now();
+
+	QSet<QByteArray> requested_chunks;
+	for(auto& remote_requests : remote_requests_)
+		requested_chunks += remote_requests;
 
+	foreach(const QByteArray& ct_hash, requested_chunks) {
 		DownloadChunkPtr chunk = down_chunks_.value(ct_hash);
+		if(! chunk) continue;
 
-		// Rebuild request map to determine, which block to download now.
-		AvailabilityMap<uint32_t> request_map = chunk->requestMap();
+		// Only requests, which are late for their remote, are duplicated. Others are expected to arrive soon anyway
+		QList<DownloadChunk::BlockRequest> overdue;
+		for(auto request_it = chunk->requests.begin(); request_it != chunk->requests.end(); ++request_it)
+			if(std::chrono::duration<double>(now - request_it->started).count() > endgameDeadline(request_it.key()))
+				overdue << *request_it;
 
-		// Request, actually
-		if(!request_map.full()) {
-			DownloadChunk::BlockRequest request;
-			request.offset = request_map.begin()->first;
-			request.size = std::min(request_map.begin()->second, uint32_t(Config::get()->getGlobal("p2p_block_size").toUInt()));
-			request.started = std::chrono::steady_clock::now();
+		foreach(RemoteFolder* owner_remote, chunk->owned_by.keys()) {
+			for(auto& request : overdue) {
+				if(! canRequest(owner_remote)) break;
 
-			remote->request_block(conv_bytearray(ct_hash), request.offset, request.size);
-			chunk->requests.insert(remote, request);
-			return true;
+				bool already_requested = false;
+				foreach(auto& owner_request, chunk->requests.values(owner_remote))
+					already_requested = already_requested || owner_request.offset == request.offset;
+				if(already_requested) continue;
+
+				DownloadChunk::BlockRequest duplicate = request;
+				duplicate.started = std::chrono::steady_clock::now();
+
+				owner_remote->request_block(conv_bytearray(ct_hash), duplicate.offset, duplicate.size);
+				addRequest(chunk, owner_remote, duplicate);
+				requested = true;
+			}
 		}
 	}
-	return false;
+	return requested;
+}
+
+void Downloader::cancelDuplicates(DownloadChunkPtr chunk, uint32_t offset, uint32_t size) {
+	QMutableHashIterator<RemoteFolder*, DownloadChunk::BlockRequest> request_it(chunk->requests);
+	while(request_it.hasNext()) {
+		request_it.next();
+		if(request_it.value().offset != offset || request_it.value().size != size) continue;
+
+		RemoteFolder* remote = request_it.key();
+		remote->cancel_block(conv_bytearray(chunk->ct_hash), offset, size);
+		request_it.remove();
+		requestsRemoved(chunk, remote, 1);
+	}
 }
 
 RemoteFolder* Downloader::nodeForRequest(QByteArray ct_hash) {
@@ -300,17 +464,145 @@ RemoteFolder* Downloader::nodeForRequest(QByteArray ct_hash) {
 	if(! chunk)
 		return nullptr;
 
-	foreach(RemoteFolder* owner_remote, chunk->owned_by.keys())
-		if(owner_remote->ready() && !owner_remote->peer_choking()) return owner_remote; // TODO: implement more smart peer selection algorithm, based on peer weights.
+	// Owner, which is expected to deliver the block first. This spreads requests between remotes in proportion to their throughput
+	RemoteFolder* best_remote = nullptr;
+	double best_completion = std::numeric_limits<double>::infinity();
+	foreach(RemoteFolder* owner_remote, chunk->owned_by.keys()) {
+		if(! canRequest(owner_remote)) continue;
+
+		double completion = expectedCompletion(owner_remote);
+		if(! best_remote || completion < best_completion) {
+			best_remote = owner_remote;
+			best_completion = completion;
+		}
+	}
+
+	return best_remote;
+}
+
+bool Downloader::canRequest(RemoteFolder* remote) const {
+	if(! remote->ready() || remote->peer_choking()) return false;
+
+	auto pipeline_it = pipelines_.find(remote);
+	return pipeline_it != pipelines_.end() && pipeline_it->in_flight < pipeline_it->window;
+}
+
+void Downloader::updatePipeline(RemoteFolder* remote, std::chrono::steady_clock::duration latency, quint64 bytes) {
+	auto pipeline_it = pipelines_.find(remote);
+	if(pipeline_it == pipelines_.end()) return;
+
+	auto now = std::chrono::steady_clock::now();
+	pipeline_it->min_latency = std::min(pipeline_it->min_latency, latency);
+	pipeline_it->latency = pipeline_it->latency == std::chrono::steady_clock::duration::zero() ? latency : (7 * pipeline_it->latency + latency) / 8;
+	pipeline_it->consecutive_timeouts = 0;
+	pipeline_it->sample_bytes += bytes;
+
+	std::chrono::steady_clock::duration rtt = remote->rtt().count() > 0 ? std::chrono::steady_clock::duration(remote->rtt()) : pipeline_it->min_latency;
+
+	// Throughput is sampled once per RTT (but not more often, than every 100ms)
+	auto sample_duration = now - pipeline_it->sample_started;
+	if(sample_duration < std::max<std::chrono::steady_clock::duration>(rtt, std::chrono::milliseconds(100))) return;
+
+	double rate = pipeline_it->sample_bytes / std::chrono::duration<double>(sample_duration).count();
+	pipeline_it->throughput = pipeline_it->throughput > 0 ? 0.75 * pipeline_it->throughput + 0.25 * rate : rate;
+	pipeline_it->sample_started = now;
+	pipeline_it->sample_bytes = 0;
+
+	// Keeping twice the bandwidth-delay product in flight. If the window is what limits the throughput, it grows exponentially, until the link is saturated
+	double bdp_blocks = pipeline_it->throughput * std::chrono::duration<double>(rtt).count() / Config::get()->getGlobal("p2p_block_size").toDouble();
+	size_t min_window = Config::get()->getGlobal("p2p_download_slots").toUInt();
+	size_t max_window = Config::get()->getGlobal("p2p_max_pipeline_blocks").toUInt();
+	pipeline_it->window = std::max(min_window, std::min(max_window, (size_t)std::ceil(2 * bdp_blocks)));
+}
+
+void Downloader::pipelineTimedOut(RemoteFolder* remote) {
+	auto pipeline_it = pipelines_.find(remote);
+	if(pipeline_it == pipelines_.end()) return;
 
-	return nullptr;
+	// Stalled remote gets less work, and is avoided by nodeForRequest() until it replies again
+	pipeline_it->consecutive_timeouts++;
+	pipeline_it->window = std::max((size_t)Config::get()->getGlobal("p2p_download_slots").toUInt(), pipeline_it->window / 2);
 }
 
-size_t Downloader::countRequests() const {
-	size_t requests = 0;
-	foreach(DownloadChunkPtr chunk, down_chunks_.values())
-		requests += chunk->requests.size();
-	return requests;
+double Downloader::expectedCompletion(RemoteFolder* remote) const {
+	auto pipeline_it = pipelines_.find(remote);
+	if(pipeline_it == pipelines_.end()) return std::numeric_limits<double>::infinity();
+
+	// Remotes, which were not measured yet, are optimistically assumed to be fast. So every remote gets some work to be measured.
+	// Latency is measured from the request, so it already includes the time, spent in the remote's queue behind other blocks
+	double latency = std::chrono::duration<double>(pipeline_it->latency).count();
+	double timeout_penalty = pipeline_it->consecutive_timeouts * Config::get()->getGlobal("p2p_request_timeout").toDouble();
+
+	return latency + timeout_penalty;
+}
+
+double Downloader::endgameDeadline(RemoteFolder* remote) const {
+	// expectedCompletion() is optimistic for remotes, which were not measured yet. It is fine for choosing a remote, but not for declaring a request late
+	auto pipeline_it = pipelines_.find(remote);
+	if(pipeline_it == pipelines_.end() || pipeline_it->latency != std::chrono::steady_clock::duration::zero())
+		return expectedCompletion(remote);
+	if(remote->rtt().count() > 0)
+		return std::chrono::duration<double>(remote->rtt()).count();
+	return Config::get()->getGlobal("p2p_request_timeout").toDouble();
+}
+
+void Downloader::addRequest(DownloadChunkPtr chunk, RemoteFolder* remote, DownloadChunk::BlockRequest request) {
+	chunk->requests.insert(remote, request);
+	requests_in_flight_++;
+
+	Pipeline& pipeline = pipelines_[remote];
+	if(pipeline.in_flight++ == 0 && pipeline.idle_since != std::chrono::steady_clock::time_point()) {
+		// The time without requests is not counted in throughput sample, otherwise a remote, which is not busy, looks slow
+		pipeline.sample_started += request.started - pipeline.idle_since;
+		pipeline.idle_since = std::chrono::steady_clock::time_point();
+	}
+	remote_requests_[remote].insert(chunk->ct_hash);
+	request_timeouts_.push_back({request.started, chunk->ct_hash, remote, request.offset});
+}
+
+void Downloader::removeRequests(DownloadChunkPtr chunk, RemoteFolder* remote) {
+	requestsRemoved(chunk, remote, chunk->requests.remove(remote));
+	updateRequestable(chunk);
+}
+
+void Downloader::requestsRemoved(DownloadChunkPtr chunk, RemoteFolder* remote, int count) {
+	requests_in_flight_ -= count;
+	auto pipeline_it = pipelines_.find(remote);
+	if(pipeline_it != pipelines_.end()) {
+		pipeline_it->in_flight -= count;
+		if(pipeline_it->in_flight == 0 && count > 0)
+			pipeline_it->idle_since = std::chrono::steady_clock::now();
+	}
+	if(chunk->requests.contains(remote)) return;
+
+	auto remote_requests_it = remote_requests_.find(remote);
+	if(remote_requests_it != remote_requests_.end()) {
+		remote_requests_it->remove(chunk->ct_hash);
+		if(remote_requests_it->isEmpty())
+			remote_requests_.erase(remote_requests_it);
+	}
+}
+
+void Downloader::expireRequests() {
+	auto expired_before = std::chrono::steady_clock::now() - std::chrono::seconds(Config::get()->getGlobal("p2p_request_timeout").toUInt());
+
+	while(!request_timeouts_.empty() && request_timeouts_.front().started < expired_before) {
+		RequestTimeout timeout = request_timeouts_.front();
+		request_timeouts_.pop_front();
+
+		DownloadChunkPtr chunk = down_chunks_.value(timeout.ct_hash);
+		if(! chunk) continue;
+
+		for(auto request_it = chunk->requests.find(timeout.remote); request_it != chunk->requests.end() && request_it.key() == timeout.remote; ++request_it) {
+			if(request_it->offset == timeout.offset && request_it->started == timeout.started) {
+				chunk->requests.erase(request_it);
+				requestsRemoved(chunk, timeout.remote, 1);
+				pipelineTimedOut(timeout.remote);
+				updateRequestable(chunk);
+				break;
+			}
+		}
+	}
 }
 
 } /* namespace librevault */
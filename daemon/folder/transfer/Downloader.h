@@ -35,6 +35,7 @@
 #include "util/log.h"
 #include <QList>
 #include <QTimer>
+#include <deque>
 #include <boost/bimap.hpp>
 #include <boost/bimap/multiset_of.hpp>
 #include <boost/bimap/unordered_set_of.hpp>
@@ -51,7 +52,7 @@ class MetaStorage;
 class ChunkStorage;
 
 struct DownloadChunk : boost::noncopyable {
-	DownloadChunk(const FolderParams& params, QByteArray ct_hash, quint32 size);
+	DownloadChunk(const FolderParams& params, ChunkFileArena* arena, QByteArray ct_hash, quint32 size, Meta::StrongHashType strong_hash_type);
 
 	ChunkFileBuilder builder;
 
@@ -66,6 +67,10 @@ struct DownloadChunk : boost::noncopyable {
 	QMultiHash<RemoteFolder*, BlockRequest> requests;
 	QHash<RemoteFolder*, std::shared_ptr<RemoteFolder::InterestGuard>> owned_by;
 
+	/* Scheduling */
+	bool clustered = false;
+	bool requestable = true;	// Has blocks, which are neither downloaded nor requested
+
 	const QByteArray ct_hash;
 };
 
@@ -75,6 +80,7 @@ class Downloader : public QObject {
 	Q_OBJECT
 signals:
 	void chunkDownloaded(QByteArray ct_hash, QFile* chunk_f);
+	void chunkDownloadedInMemory(QByteArray ct_hash, QByteArray chunk_ct);
 
 public:
 	Downloader(const FolderParams& params, MetaStorage* meta_storage, QObject* parent);
@@ -83,6 +89,7 @@ public:
 public slots:
 	void notifyLocalMeta(const SignedMeta& smeta, const bitfield_type& bitfield);
 	void notifyLocalChunk(const blob& ct_hash);
+	void notifyChunkNotStored(QByteArray ct_hash);	// Downloaded chunk could not be stored, so it is downloaded again
 
 	void notifyRemoteMeta(RemoteFolder* remote, const Meta::PathRevision& revision, bitfield_type bitfield);
 	void notifyRemoteChunk(RemoteFolder* remote, const blob& ct_hash);
@@ -99,19 +106,73 @@ private:
 	const FolderParams& params_;
 	MetaStorage* meta_storage_;
 
+	ChunkFileArena arena_;  // Must outlive down_chunks_
 	QHash<QByteArray, DownloadChunkPtr> down_chunks_;
-	WeightedChunkQueue download_queue_;
 
-	size_t countRequests() const;
+	/* Every remote has a queue of requestable chunks, which it owns. requestOne() merges queues of remotes with free window by their heads,
+	 * so chunks, which can't be requested right now, are never walked through */
+	QHash<RemoteFolder*, WeightedChunkQueue> remote_queues_;
+	void requeue(DownloadChunkPtr chunk);	// Updates the chunk in queues of all its owners
+	void updateRequestable(DownloadChunkPtr chunk);
+	void markClustered(const QByteArray& ct_hash);
+
+	/* Request bookkeeping. Indexed, so a received block doesn't cost a walk over all missing chunks */
+	size_t requests_in_flight_ = 0;
+	QHash<RemoteFolder*, QSet<QByteArray>> remote_requests_;	// Chunks with requests, sent to this remote
+	QHash<RemoteFolder*, QSet<QByteArray>> remote_chunks_;	// Chunks, owned by this remote
+
+	struct RequestTimeout {
+		std::chrono::steady_clock::time_point started;
+		QByteArray ct_hash;
+		RemoteFolder* remote;
+		uint32_t offset;
+	};
+	std::deque<RequestTimeout> request_timeouts_;	// Ordered by start time, as the timeout is the same for all requests. Answered requests are skipped on expiry
+
+	void addRequest(DownloadChunkPtr chunk, RemoteFolder* remote, DownloadChunk::BlockRequest request);
+	void removeRequests(DownloadChunkPtr chunk, RemoteFolder* remote);
+	void requestsRemoved(DownloadChunkPtr chunk, RemoteFolder* remote, int count);	// Updates indexes after requests were removed from chunk->requests
+	void expireRequests();
+
+	size_t countRequests() const {return requests_in_flight_;}
+
+	/* Request pipelining. Every remote has its own window of outstanding blocks, sized by its bandwidth-delay product */
+	struct Pipeline {
+		size_t in_flight = 0;
+		size_t window = 0;
+		double throughput = 0;	// Bytes per second, smoothed
+		std::chrono::steady_clock::duration min_latency = std::chrono::steady_clock::duration::max();	// Lowest request-to-reply time. Used, until rtt() is measured
+		std::chrono::steady_clock::time_point sample_started;
+		quint64 sample_bytes = 0;
+		std::chrono::steady_clock::time_point idle_since;	// When the last request in flight was completed. Empty, while requests are in flight
+
+		/* Peer scoring */
+		std::chrono::steady_clock::duration latency = std::chrono::steady_clock::duration::zero();	// Request-to-reply time, smoothed
+		int consecutive_timeouts = 0;
+	};
+	QHash<RemoteFolder*, Pipeline> pipelines_;
+
+	bool canRequest(RemoteFolder* remote) const;
+	void updatePipeline(RemoteFolder* remote, std::chrono::steady_clock::duration latency, quint64 bytes);
+	void pipelineTimedOut(RemoteFolder* remote);
+	double expectedCompletion(RemoteFolder* remote) const;	// Estimated time in seconds, until a newly requested block arrives from this remote
+	double endgameDeadline(RemoteFolder* remote) const;	// Time in seconds, after which a request to this remote is duplicated in endgame
 
 	/* Request process */
 	QTimer* maintain_timer_;
 
 	void maintainRequests();
 	bool requestOne();
+
+	/* Endgame. When every block, which can be downloaded, is downloaded or requested, overdue requests are duplicated to other owners.
+	 * Checked on maintain_timer_ ticks, not after every received block */
+	void maintainEndgame();
+	bool inEndgame() const;
+	bool requestEndgame();
+	void cancelDuplicates(DownloadChunkPtr chunk, uint32_t offset, uint32_t size);
 	RemoteFolder* nodeForRequest(QByteArray ct_hash);
 
-	void addChunk(QByteArray ct_hash, quint32 size);
+	void addChunk(QByteArray ct_hash, quint32 size, Meta::StrongHashType strong_hash_type);
 	void removeChunk(QByteArray ct_hash);
 
 	/* Node management */
@@ -46,14 +46,15 @@ void MetaUploader::broadcast_meta(QList<RemoteFolder*> remotes, const Meta::Path
 }
 
 void MetaUploader::handle_handshake(RemoteFolder* remote) {
-	for(auto& meta : meta_storage_->getMeta()) {
-		remote->post_have_meta(meta.meta().path_revision(), chunk_storage_->make_bitfield(meta.meta()));
-	}
+	meta_storage_->forEachMetaBitfield([=](const SignedMeta& meta, const QByteArray& stored_bitfield){
+		remote->post_have_meta(meta.meta().path_revision(), chunk_storage_->make_bitfield(meta.meta(), stored_bitfield));
+	});
 }
 
 void MetaUploader::handle_meta_request(RemoteFolder* remote, const Meta::PathRevision& revision) {
 	try {
-		remote->post_meta(meta_storage_->getMeta(revision), chunk_storage_->make_bitfield(meta_storage_->getMeta(revision).meta()));
+		SignedMeta smeta = meta_storage_->getMeta(revision);
+		remote->post_meta(smeta, chunk_storage_->make_bitfield(smeta.meta(), meta_storage_->getBitfield(revision.path_id_)));
 	}catch(MetaStorage::no_such_meta& e){
 		LOGW("Requested nonexistent Meta");
 	}
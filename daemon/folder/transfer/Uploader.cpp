@@ -27,8 +27,10 @@
  * files in the program, then also delete it here.
  */
 #include "Uploader.h"
+#include "control/Config.h"
 #include "folder/chunk/ChunkStorage.h"
 #include "folder/RemoteFolder.h"
+#include <QTimer>
 
 namespace librevault {
 
@@ -36,6 +38,7 @@ Uploader::Uploader(ChunkStorage* chunk_storage, QObject* parent) :
 	QObject(parent),
 	chunk_storage_(chunk_storage) {
 	LOGFUNC();
+	max_pending_requests_ = Config::get()->getGlobal("p2p_max_pipeline_blocks").toUInt();
 }
 
 void Uploader::broadcast_chunk(QList<RemoteFolder*> remotes, const blob& ct_hash) {
@@ -58,21 +61,72 @@ void Uploader::handle_not_interested(RemoteFolder* remote) {
 }
 
 void Uploader::handle_block_request(RemoteFolder* remote, const blob& ct_hash, uint32_t offset, uint32_t size) noexcept {
-	try {
-		if(!remote->am_choking() && remote->peer_interested()) {
-			remote->post_block(ct_hash, offset, get_block(ct_hash, offset, size));
+	if(!remote->am_choking() && remote->peer_interested()) {
+		auto& requests = pending_requests_[remote];
+		if(requests.size() >= max_pending_requests_) {
+			// No honest downloader keeps more requests in flight. Dropped request expires on its side, and is requested again
+			LOGD("Dropped block request: too many pending requests from remote");
+			return;
 		}
-	}catch(ChunkStorage::no_such_chunk& e){
-		LOGW("Requested nonexistent block");
+		requests.push_back({ct_hash, offset, size});
+		schedule_processing();
 	}
 }
 
+void Uploader::handle_block_cancel(RemoteFolder* remote, const blob& ct_hash, uint32_t offset, uint32_t size) noexcept {
+	auto pending_it = pending_requests_.find(remote);
+	if(pending_it == pending_requests_.end()) return;
+
+	auto& requests = *pending_it;
+	for(auto request_it = requests.begin(); request_it != requests.end(); ++request_it) {
+		if(request_it->ct_hash == ct_hash && request_it->offset == offset && request_it->size == size) {
+			requests.erase(request_it);
+			break;
+		}
+	}
+}
+
+void Uploader::untrack_remote(RemoteFolder* remote) {
+	pending_requests_.remove(remote);
+}
+
+void Uploader::schedule_processing() {
+	if(processing_scheduled_) return;
+	processing_scheduled_ = true;
+	QTimer::singleShot(0, this, &Uploader::process_requests);
+}
+
+void Uploader::process_requests() {
+	processing_scheduled_ = false;
+
+	for(auto pending_it = pending_requests_.begin(); pending_it != pending_requests_.end();) {
+		RemoteFolder* remote = pending_it.key();
+		auto& requests = *pending_it;
+
+		for(int i = 0; i < batch_size_ && !requests.empty(); i++) {
+			BlockRequest request = requests.front();
+			requests.pop_front();
+
+			try {
+				if(!remote->am_choking() && remote->peer_interested())
+					remote->post_block(request.ct_hash, request.offset, get_block(request.ct_hash, request.offset, request.size));
+			}catch(ChunkStorage::no_such_chunk& e){
+				LOGW("Requested nonexistent block");
+			}
+		}
+
+		if(requests.empty())
+			pending_it = pending_requests_.erase(pending_it);
+		else
+			++pending_it;
+	}
+
+	if(!pending_requests_.isEmpty())
+		schedule_processing();
+}
+
 blob Uploader::get_block(const blob& ct_hash, uint32_t offset, uint32_t size) {
-	auto chunk = chunk_storage_->get_chunk(ct_hash);
-	if((int)offset < chunk.size() && (int)size <= chunk.size()-(int)offset)
-		return blob(chunk.begin()+offset, chunk.begin()+offset+size);
-	else
-		throw ChunkStorage::no_such_chunk();
+	return conv_bytearray(chunk_storage_->read_block(ct_hash, offset, size));
 }
 
 } /* namespace librevault */
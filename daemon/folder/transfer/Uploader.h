@@ -29,8 +29,9 @@
 #pragma once
 #include "util/log.h"
 #include "blob.h"
+#include <QHash>
 #include <QObject>
-#include <set>
+#include <deque>
 
 namespace librevault {
 
@@ -50,10 +51,27 @@ public:
 	void handle_not_interested(RemoteFolder* remote);
 
 	void handle_block_request(RemoteFolder* remote, const blob& ct_hash, uint32_t offset, uint32_t size) noexcept;
+	void handle_block_cancel(RemoteFolder* remote, const blob& ct_hash, uint32_t offset, uint32_t size) noexcept;
+
+	void untrack_remote(RemoteFolder* remote);
 
 private:
 	ChunkStorage* chunk_storage_;
 
+	/* Requests are queued and answered in small batches, so a BLOCK_CANCEL, received meanwhile, drops the reply */
+	struct BlockRequest {
+		blob ct_hash;
+		uint32_t offset;
+		uint32_t size;
+	};
+	QHash<RemoteFolder*, std::deque<BlockRequest>> pending_requests_;
+	bool processing_scheduled_ = false;
+	const int batch_size_ = 8;	// Replies per remote per event loop iteration
+	size_t max_pending_requests_;	// Per remote. Same as the largest download window, p2p_max_pipeline_blocks
+
+	void schedule_processing();
+	void process_requests();
+
 	blob get_block(const blob& ct_hash, uint32_t offset, uint32_t size);
 };
 
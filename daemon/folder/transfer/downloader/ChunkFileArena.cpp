@@ -0,0 +1,194 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "ChunkFileArena.h"
+#include "control/Config.h"
+#include "util/preallocate.h"
+#include <QLoggingCategory>
+#include <algorithm>
+#include <iterator>
+#ifdef Q_OS_UNIX
+#   include <unistd.h>
+#endif
+#ifdef Q_OS_LINUX
+#   include <sys/syscall.h>
+#endif
+
+namespace librevault {
+
+Q_DECLARE_LOGGING_CATEGORY(log_downloader)
+
+ChunkFileArena::ChunkFileArena(QString system_path) {
+	memory_chunk_size_ = Config::get()->getGlobal("p2p_memory_chunk_size").toUInt();
+
+	for(int i = 0; i < arena_files_; i++) {
+		ArenaFile file;
+		file.f = std::make_unique<QFile>(system_path + QString("/download-%1.arena").arg(i));
+		if(! file.f->open(QIODevice::ReadWrite | QIODevice::Truncate | QIODevice::Unbuffered))
+			qCWarning(log_downloader) << "Could not open" << file.f->fileName() << "Error:" << file.f->errorString();
+		files_.push_back(std::move(file));
+	}
+}
+
+ChunkFileArena::~ChunkFileArena() {
+	for(auto& file : files_)
+		file.f->remove();
+}
+
+ChunkFileArena::Slot ChunkFileArena::allocate(quint32 size) {
+	Slot slot;
+	slot.size = size;
+
+	// First fit in freed space
+	for(int i = 0; i < (int)files_.size(); i++) {
+		auto& free_extents = files_[i].free_extents;
+		for(auto extent_it = free_extents.begin(); extent_it != free_extents.end(); extent_it++) {
+			if(extent_it->second < size) continue;
+
+			slot.file = i;
+			slot.offset = extent_it->first;
+			if(extent_it->second > size)
+				free_extents.insert({extent_it->first + size, extent_it->second - size});
+			free_extents.erase(extent_it);
+			return slot;
+		}
+	}
+
+	// Growing the least used file
+	int least_used = -1;
+	for(int i = 0; i < (int)files_.size(); i++)
+		if(files_[i].f->isOpen() && (least_used < 0 || files_[i].used_size < files_[least_used].used_size))
+			least_used = i;
+	if(least_used < 0) return slot;
+
+	ArenaFile& file = files_[least_used];
+	if(file.used_size + size > file.preallocated_size) {
+		quint64 new_size = std::max(initial_size_, ((file.used_size + size + grow_step_ - 1) / grow_step_) * grow_step_);
+		if(! preallocate(*file.f, new_size)) {
+			qCWarning(log_downloader) << "Could not grow" << file.f->fileName() << "Error:" << file.f->errorString();
+			return slot;
+		}
+		file.preallocated_size = new_size;
+	}
+
+	slot.file = least_used;
+	slot.offset = file.used_size;
+	file.used_size += size;
+	return slot;
+}
+
+void ChunkFileArena::release(Slot slot) {
+	if(! slot.isValid()) return;
+	ArenaFile& file = files_[slot.file];
+
+	quint64 offset = slot.offset, size = slot.size;
+
+	// Coalescing with neighbor extents
+	auto next_it = file.free_extents.lower_bound(offset);
+	if(next_it != file.free_extents.end() && next_it->first == offset + size) {
+		size += next_it->second;
+		next_it = file.free_extents.erase(next_it);
+	}
+	if(next_it != file.free_extents.begin()) {
+		auto prev_it = std::prev(next_it);
+		if(prev_it->first + prev_it->second == offset) {
+			offset = prev_it->first;
+			size += prev_it->second;
+			file.free_extents.erase(prev_it);
+		}
+	}
+
+	if(offset + size == file.used_size)
+		file.used_size = offset;    // Tail is not tracked as an extent
+	else
+		file.free_extents.insert({offset, size});
+
+	// Giving back disk space after a burst of downloads
+	if(file.used_size == 0 && file.preallocated_size > initial_size_ && file.f->resize(initial_size_))
+		file.preallocated_size = initial_size_;
+}
+
+bool ChunkFileArena::write(const Slot& slot, quint32 offset, const QByteArray& content) {
+	if(! slot.isValid() || quint64(offset) + content.size() > slot.size) return false;
+	QFile* f = files_[slot.file].f.get();
+
+#ifdef Q_OS_UNIX
+	return pwrite(f->handle(), content.data(), content.size(), slot.offset + offset) == content.size();
+#else
+	return f->seek(slot.offset + offset) && f->write(content) == content.size();
+#endif
+}
+
+QFile* ChunkFileArena::promote(Slot slot, QString path) {
+	if(! slot.isValid()) return nullptr;
+
+	QFile* chunk_f = new QFile(path);
+	bool promoted = chunk_f->open(QIODevice::ReadWrite | QIODevice::Truncate)
+		&& copyRange(*files_[slot.file].f, slot.offset, *chunk_f, slot.size);
+	release(slot);
+
+	if(! promoted) {
+		qCWarning(log_downloader) << "Could not promote downloaded chunk to" << path << "Error:" << chunk_f->errorString();
+		chunk_f->remove();
+		delete chunk_f;
+		return nullptr;
+	}
+	chunk_f->seek(0);
+	return chunk_f;
+}
+
+QByteArray ChunkFileArena::takeBuffer(quint32 size) {
+	QByteArray buffer = buffers_.isEmpty() ? QByteArray() : buffers_.takeLast();
+	buffer.resize(size);    // Shrinking keeps the allocated capacity
+	return buffer;
+}
+
+void ChunkFileArena::returnBuffer(QByteArray buffer) {
+	if(!buffer.isNull() && buffers_.size() < buffer_pool_size_)
+		buffers_.append(buffer);
+}
+
+bool ChunkFileArena::copyRange(QFile& src_f, quint64 src_offset, QFile& dst_f, quint64 size) {
+	quint64 dst_offset = 0;
+#if defined(Q_OS_LINUX) && defined(SYS_copy_file_range)
+	loff_t src_off = src_offset, dst_off = 0;
+	while(size > 0) {
+		ssize_t copied = syscall(SYS_copy_file_range, src_f.handle(), &src_off, dst_f.handle(), &dst_off, size, 0u);
+		if(copied <= 0) break;	// Not supported by kernel or filesystem. Falling back to userspace copy
+		size -= copied;
+	}
+	src_offset = src_off;
+	dst_offset = dst_off;
+	if(size == 0) return true;
+#endif
+	if(! src_f.seek(src_offset) || ! dst_f.seek(dst_offset)) return false;
+	QByteArray buffer = src_f.read(size);
+	return buffer.size() == (int)size && dst_f.write(buffer) == buffer.size();
+}
+
+} /* namespace librevault */
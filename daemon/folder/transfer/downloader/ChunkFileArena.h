@@ -0,0 +1,84 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QFile>
+#include <QList>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace librevault {
+
+/* ChunkFileArena is a download staging area. Chunks, being downloaded, are written into slots of a few preallocated files,
+ * instead of a separate file per chunk. Arena files are opened once, so the number of open descriptors is bounded by arena_files_ */
+class ChunkFileArena {
+public:
+	struct Slot {
+		int file = -1;
+		quint64 offset = 0;
+		quint32 size = 0;
+
+		bool isValid() const {return file >= 0;}
+	};
+
+	ChunkFileArena(QString system_path);
+	~ChunkFileArena();
+
+	Slot allocate(quint32 size);
+	void release(Slot slot);
+
+	bool write(const Slot& slot, quint32 offset, const QByteArray& content);
+	QFile* promote(Slot slot, QString path);  // Copies slot contents into a new file at path and releases the slot. Returns opened file, or nullptr on error
+
+	/* Chunks up to memoryChunkSize() are downloaded into pooled buffers instead of slots */
+	quint32 memoryChunkSize() const {return memory_chunk_size_;}
+	QByteArray takeBuffer(quint32 size);
+	void returnBuffer(QByteArray buffer);
+
+private:
+	const int arena_files_ = 4;
+	const quint64 initial_size_ = 16*1024*1024;
+	const quint64 grow_step_ = 16*1024*1024;
+
+	struct ArenaFile {
+		std::unique_ptr<QFile> f;
+		quint64 used_size = 0;  // End of last allocated slot, or freed space
+		quint64 preallocated_size = 0;
+		std::map<quint64, quint64> free_extents;	// offset -> size, coalesced
+	};
+	std::vector<ArenaFile> files_;
+
+	quint32 memory_chunk_size_;
+	const int buffer_pool_size_ = 16;
+	QList<QByteArray> buffers_;
+
+	bool copyRange(QFile& src_f, quint64 src_offset, QFile& dst_f, quint64 size);
+};
+
+} /* namespace librevault */
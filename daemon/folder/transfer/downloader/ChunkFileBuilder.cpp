@@ -27,6 +27,7 @@
  * files in the program, then also delete it here.
  */
 #include "ChunkFileBuilder.h"
+#include "util/readable.h"
 #include <librevault/crypto/Base32.h>
 #include <QLoggingCategory>
 
@@ -34,48 +35,66 @@ namespace librevault {
 
 Q_DECLARE_LOGGING_CATEGORY(log_downloader)
 
-/* ChunkFileBuilderFdPool */
-QFile* ChunkFileBuilderFdPool::getFile(QString path, bool release) {
-	QFile* f = !release ? opened_files_[path] : opened_files_.take(path);
-	if(f)
-		return f;
-
-	f = new QFile(path);
-	if(! f->open(QIODevice::ReadWrite))
-		qCWarning(log_downloader) << "Could not open" << path << "Error:" << f->errorString();
-	opened_files_.insert(path, f);
-
-	return f;
-}
-
 /* ChunkFileBuilder */
-ChunkFileBuilder::ChunkFileBuilder(QString system_path, QByteArray ct_hash, quint32 size) : file_map_(size) {
+ChunkFileBuilder::ChunkFileBuilder(ChunkFileArena* arena, QString system_path, QByteArray ct_hash, quint32 size, Meta::StrongHashType strong_hash_type) :
+	arena_(arena),
+	file_map_(size),
+	ct_hash_(ct_hash),
+	strong_hash_type_(strong_hash_type),
+	in_memory_(size <= arena->memoryChunkSize()) {
 	chunk_location_ = system_path + "/incomplete-" + conv_bytearray(ct_hash | crypto::Base32());
-
-	QFile f(chunk_location_);
-	f.open(QIODevice::WriteOnly | QIODevice::Truncate);
-	f.resize(size);
 }
 
 ChunkFileBuilder::~ChunkFileBuilder() {
-	if(! chunk_location_.isEmpty())
-		QFile::remove(chunk_location_);
+	arena_->release(slot_);
+	arena_->returnBuffer(buffer_);
 }
 
 QFile* ChunkFileBuilder::release_chunk() {
-	QFile* f = ChunkFileBuilderFdPool::get_instance()->getFile(chunk_location_, true);
-	chunk_location_.clear();
+	QFile* f = arena_->promote(slot_, chunk_location_);
+	slot_ = ChunkFileArena::Slot();
+	if(!f)
+		reset();
 	return f;
 }
 
+QByteArray ChunkFileBuilder::release_chunk_data() {
+	QByteArray chunk_ct(buffer_.constData(), buffer_.size());
+	arena_->returnBuffer(buffer_);
+	buffer_ = QByteArray();
+
+	if(Meta::Chunk::compute_strong_hash(conv_bytearray(chunk_ct), strong_hash_type_) != conv_bytearray(ct_hash_)) {
+		qCWarning(log_downloader) << "Downloaded chunk" << ct_hash_readable(ct_hash_) << "has invalid hash, downloading again";
+		reset();
+		return QByteArray();
+	}
+	return chunk_ct;
+}
+
+void ChunkFileBuilder::reset() {
+	file_map_ = AvailabilityMap<quint32>(file_map_.size_original());
+}
+
 void ChunkFileBuilder::put_block(quint32 offset, const QByteArray& content) {
-	auto inserted = file_map_.insert({offset, content.size()}).second;
-	if(inserted) {
-		QFile* f = ChunkFileBuilderFdPool::get_instance()->getFile(chunk_location_);
-		if(f->pos() != offset)
-			f->seek(offset);
-		f->write(content);
+	if(in_memory_) {
+		if(buffer_.isNull())
+			buffer_ = arena_->takeBuffer(file_map_.size_original());
+		if(file_map_.insert({offset, content.size()}).second)
+			std::copy(content.begin(), content.end(), buffer_.begin() + offset);
+		return;
 	}
+
+	if(! slot_.isValid()) {
+		slot_ = arena_->allocate(file_map_.size_original());
+		if(! slot_.isValid()) return;
+	}
+
+	// Block is marked as received only after it is written, so a failed write leaves it to be requested again
+	if(!file_map_.insertable({offset, content.size()})) return;
+	if(arena_->write(slot_, offset, content))
+		file_map_.insert({offset, content.size()});
+	else
+		qCWarning(log_downloader) << "Could not write block into download arena";
 }
 
 } /* namespace librevault */
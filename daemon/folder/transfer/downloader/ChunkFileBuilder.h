@@ -27,46 +27,42 @@
  * files in the program, then also delete it here.
  */
 #pragma once
+#include "ChunkFileArena.h"
 #include "util/AvailabilityMap.h"
 #include "blob.h"
-#include <QCache>
+#include <librevault/Meta.h>
 #include <QFile>
 
 namespace librevault {
 
-/* ChunkFileBuilderFdPool is a singleton class, used to open/close files automatically to reduce simultaneously open file descriptors */
-class ChunkFileBuilderFdPool {
-public:
-	static ChunkFileBuilderFdPool* get_instance() {
-		static ChunkFileBuilderFdPool* instance;
-		if(!instance)
-			instance = new ChunkFileBuilderFdPool();
-		return instance;
-	}
-
-	QFile* getFile(QString path, bool release = false);
-
-private:
-	QCache<QString, QFile> opened_files_;
-};
-
-/* ChunkFileBuilder constructs a chunk in a file. If complete(), then an encrypted chunk is located in  */
+/* ChunkFileBuilder constructs a chunk in a slot of ChunkFileArena. If complete(), then an encrypted chunk is released into a separate file.
+ * Small chunks are constructed in memory instead, and are verified before release */
 class ChunkFileBuilder {
 public:
-	ChunkFileBuilder(QString system_path, QByteArray ct_hash, quint32 size);
+	ChunkFileBuilder(ChunkFileArena* arena, QString system_path, QByteArray ct_hash, quint32 size, Meta::StrongHashType strong_hash_type);
 	~ChunkFileBuilder();
 
-	QFile* release_chunk();
+	QFile* release_chunk();  // Returns nullptr, if the chunk could not be released. Then it is downloaded again
+	QByteArray release_chunk_data();  // For in_memory() chunks. Returns null QByteArray, if the hash is invalid. Then it is downloaded again
 	void put_block(quint32 offset, const QByteArray& content);
+	void reset();	// Forgets all received blocks, so the chunk is downloaded again
 
 	uint64_t size() const {return file_map_.size_original();}
 	bool complete() const {return file_map_.full();}
+	bool in_memory() const {return in_memory_;}
 
 	const AvailabilityMap<quint32>& file_map() const {return file_map_;}
 
 private:
+	ChunkFileArena* arena_;
+	ChunkFileArena::Slot slot_;	// Allocated on first block, so queued chunks don't occupy the arena
 	AvailabilityMap<quint32> file_map_;
 	QString chunk_location_;
+
+	QByteArray ct_hash_;
+	Meta::StrongHashType strong_hash_type_;
+	bool in_memory_;
+	QByteArray buffer_;	// Taken from arena's pool on first block
 };
 
 } /* namespace librevault */
@@ -27,86 +27,89 @@
  * files in the program, then also delete it here.
  */
 #include "WeightedChunkQueue.h"
-#include <QLoggingCategory>
-#include <boost/range/adaptor/map.hpp>
 
 namespace librevault {
 
-float WeightedChunkQueue::Weight::value() const {
+float WeightedChunkQueue::Weight::value(int remotes_count) const {
 	float weight_value = 0;
 
 	weight_value += CLUSTERED_COEFFICIENT * (clustered ? 1 : 0);
 	weight_value += IMMEDIATE_COEFFICIENT * (immediate ? 1 : 0);
-	float rarity = (float)(remotes_count - owned_by) / (float)remotes_count;
+	float rarity = remotes_count > 0 ? (float)(remotes_count - owned_by) / (float)remotes_count : 0;
 	weight_value += rarity * RARITY_COEFFICIENT;
 
 	return weight_value;
 }
 
-WeightedChunkQueue::Weight WeightedChunkQueue::getCurrentWeight(QByteArray chunk) {
-	auto it = weight_ordered_chunks_.left.find(chunk);
-	if(it != weight_ordered_chunks_.left.end())
-		return it->second;
-	else
-		return Weight();
-}
-
-void WeightedChunkQueue::reweightChunk(QByteArray chunk, Weight new_weight) {
-	auto chunk_it = weight_ordered_chunks_.left.find(chunk);
+void WeightedChunkQueue::reweightChunk(QByteArray chunk, const std::function<void(Weight&)>& update) {
+	auto weight_it = weights_.find(chunk);
+	if(weight_it == weights_.end()) return;
 
-	if(chunk_it != weight_ordered_chunks_.left.end() && chunk_it->second != new_weight) {
-		weight_ordered_chunks_.left.erase(chunk_it);
-		weight_ordered_chunks_.left.insert(queue_left_value(chunk, new_weight));
-	}
+	ordered_chunks_[weight_it->flagsClass()].erase({weight_it->orderKey(), chunk});
+	update(*weight_it);
+	ordered_chunks_[weight_it->flagsClass()].insert({weight_it->orderKey(), chunk});
 }
 
 void WeightedChunkQueue::addChunk(QByteArray chunk) {
-	weight_ordered_chunks_.left.insert(queue_left_value(chunk, Weight()));
+	if(weights_.contains(chunk)) return;
+
+	Weight weight;
+	weights_.insert(chunk, weight);
+	ordered_chunks_[weight.flagsClass()].insert({weight.orderKey(), chunk});
 }
 
 void WeightedChunkQueue::removeChunk(QByteArray chunk) {
-	weight_ordered_chunks_.left.erase(chunk);
+	auto weight_it = weights_.find(chunk);
+	if(weight_it == weights_.end()) return;
+
+	ordered_chunks_[weight_it->flagsClass()].erase({weight_it->orderKey(), chunk});
+	weights_.erase(weight_it);
 }
 
 void WeightedChunkQueue::setRemotesCount(int count) {
-	weight_ordered_chunks_t new_queue;
-	for(auto& entry : weight_ordered_chunks_.left) {
-		QByteArray chunk = entry.first;
-		Weight weight = entry.second;
-
-		weight.remotes_count = count;
-		new_queue.left.insert(queue_left_value(chunk, weight));
-	}
-	weight_ordered_chunks_ = new_queue;
+	remotes_count_ = count;   // Applied lazily by Cursor
 }
 
 void WeightedChunkQueue::setRemotesCount(QByteArray chunk, int count) {
-	Weight weight = getCurrentWeight(chunk);
-	weight.owned_by = count;
-
-	reweightChunk(chunk, weight);
+	reweightChunk(chunk, [=](Weight& weight){weight.owned_by = count;});
 }
 
 void WeightedChunkQueue::markClustered(QByteArray chunk) {
-	Weight weight = getCurrentWeight(chunk);
-	weight.clustered = true;
-
-	reweightChunk(chunk, weight);
+	reweightChunk(chunk, [](Weight& weight){weight.clustered = true;});
 }
 
 void WeightedChunkQueue::markImmediate(QByteArray chunk) {
-	Weight weight = getCurrentWeight(chunk);
-	weight.immediate = true;
+	reweightChunk(chunk, [](Weight& weight){weight.immediate = true;});
+}
 
-	reweightChunk(chunk, weight);
+/* Cursor */
+WeightedChunkQueue::Cursor::Cursor(const WeightedChunkQueue* queue) : queue_(queue) {
+	for(size_t flags_class = 0; flags_class < positions_.size(); flags_class++)
+		positions_[flags_class] = queue_->ordered_chunks_[flags_class].begin();
 }
 
-QList<QByteArray> WeightedChunkQueue::chunks() const {
-	QList<QByteArray> chunk_list;
-	chunk_list.reserve(weight_ordered_chunks_.size());
-	for(auto& chunk_ptr : boost::adaptors::values(weight_ordered_chunks_.right))
-		chunk_list << chunk_ptr;
-	return chunk_list;
+bool WeightedChunkQueue::Cursor::next(QByteArray& chunk) {
+	int best_class = -1;
+	float best_value = 0;
+
+	// Heads of flag classes are the only candidates. The heaviest of them is the next chunk
+	for(int flags_class = 0; flags_class < (int)positions_.size(); flags_class++) {
+		if(positions_[flags_class] == queue_->ordered_chunks_[flags_class].end()) continue;
+
+		Weight weight = queue_->weights_.value(positions_[flags_class]->second);
+		if(!weight.available()) continue;
+
+		float value = weight.value(queue_->remotes_count_);
+		if(best_class < 0 || value > best_value) {
+			best_class = flags_class;
+			best_value = value;
+		}
+	}
+	if(best_class < 0) return false;
+
+	chunk = positions_[best_class]->second;
+	++positions_[best_class];
+	return true;
 }
 
 } /* namespace librevault */
@@ -27,50 +27,60 @@
  * files in the program, then also delete it here.
  */
 #pragma once
-#include <QList>
-#include <boost/bimap.hpp>
-#include <boost/bimap/multiset_of.hpp>
-#include <boost/bimap/unordered_set_of.hpp>
+#include <QByteArray>
+#include <QHash>
+#include <array>
+#include <functional>
+#include <limits>
+#include <set>
 
 #define CLUSTERED_COEFFICIENT 10.0f
 #define IMMEDIATE_COEFFICIENT 20.0f
 #define RARITY_COEFFICIENT 25.0f
 
-inline std::size_t hash_value(const QByteArray& val) {
-	return qHash(val);
-}
-
 namespace librevault {
 
 class FolderParams;
 class MetaStorage;
 class ChunkStorage;
 
+/* WeightedChunkQueue orders missing chunks by weight.
+ * Weight depends on the global remotes count only through the rarity term, which is the same for all chunks with equal owned_by.
+ * So, chunks are kept in 4 sets (one per combination of "clustered" and "immediate" flags), ordered by owned_by only,
+ * and the sets are merged lazily by Cursor. Changing the remotes count is O(1), other updates are O(log n). */
 class WeightedChunkQueue {
 	struct Weight {
 		bool clustered = false;
 		bool immediate = false;
 
 		int owned_by = 0;
-		int remotes_count = 0;
 
-		float value() const;
-		bool operator<(const Weight& b) const {return value() > b.value();}
-		bool operator==(const Weight& b) const {return value() == b.value();}
-		bool operator!=(const Weight& b) const {return !(*this == b);}
+		bool available() const {return owned_by > 0;}
+		int flagsClass() const {return (clustered ? 1 : 0) | (immediate ? 2 : 0);}
+		int orderKey() const {return available() ? owned_by : std::numeric_limits<int>::max();}	// Rarer go first. Chunks, which nobody has, go last
+		float value(int remotes_count) const;
 	};
-	using weight_ordered_chunks_t = boost::bimap<
-		boost::bimaps::unordered_set_of<QByteArray>,
-		boost::bimaps::multiset_of<Weight>
-	>;
-	using queue_left_value = weight_ordered_chunks_t::left_value_type;
-	using queue_right_value = weight_ordered_chunks_t::right_value_type;
-	weight_ordered_chunks_t weight_ordered_chunks_;
+	using ordered_chunks_t = std::set<std::pair<int, QByteArray>>;	// (orderKey, ct_hash)
+
+	QHash<QByteArray, Weight> weights_;
+	std::array<ordered_chunks_t, 4> ordered_chunks_;	// Indexed by Weight::flagsClass()
+	int remotes_count_ = 0;
 
-	Weight getCurrentWeight(QByteArray chunk);
-	void reweightChunk(QByteArray chunk, Weight new_weight);
+	void reweightChunk(QByteArray chunk, const std::function<void(Weight&)>& update);
 
 public:
+	/* Cursor walks chunks from the heaviest one, merging flag classes on the fly. It is invalidated by any modification of the queue */
+	class Cursor {
+	public:
+		bool next(QByteArray& chunk);	// Returns false, when no more chunks, owned by someone, are left
+	private:
+		friend class WeightedChunkQueue;
+		Cursor(const WeightedChunkQueue* queue);
+
+		const WeightedChunkQueue* queue_;
+		std::array<ordered_chunks_t::const_iterator, 4> positions_;
+	};
+
 	void addChunk(QByteArray chunk);
 	void removeChunk(QByteArray chunk);
 
@@ -80,7 +90,11 @@ public:
 	void markClustered(QByteArray chunk);
 	void markImmediate(QByteArray chunk);
 
-	QList<QByteArray> chunks() const;
+	/* The heaviest chunk, owned by someone, and its weight. O(1), so several queues can be merged by their heads without walking them */
+	bool top(QByteArray& chunk) const {return cursor().next(chunk);}
+	float weight(const QByteArray& chunk) const {return weights_.value(chunk).value(remotes_count_);}
+
+	Cursor cursor() const {return Cursor(this);}
 };
 
 } /* namespace librevault */
@@ -443,7 +443,6 @@ void P2PFolder::handle_BlockReply(const blob& message_raw) {
 	emit rcvdBlockReply(message_struct.ct_hash, message_struct.offset, message_struct.content);
 }
 void P2PFolder::handle_BlockCancel(const blob& message_raw) {
-#   warning "Not implemented yet"
 	LOGFUNC();
 
 	auto message_struct = V1Parser().parse_BlockCancel(message_raw);
@@ -72,6 +72,7 @@ public:
 	// Handshake
 	void sendHandshake();
 	bool ready() const {return handshake_sent_ && handshake_received_;}
+	std::chrono::milliseconds rtt() const {return rtt_;}
 
 	/* Message senders */
 	void choke();
@@ -72,6 +72,18 @@ public:
 		return true;
 	}
 
+	// Returns true, if insert() of this block would succeed
+	bool insertable(block_type block) const {
+		if(block.first >= size_original_ || block.first+block.second > size_original_ || available_map_.empty()) return false;
+
+		auto space_it = available_map_.upper_bound(block.first);
+		if(space_it == available_map_.begin()) return false;
+		--space_it;
+
+		block_type block_left, block_right;
+		return slice_superset(block, *space_it, block_left, block_right);
+	}
+
 	std::pair<const_iterator, bool> insert(block_type block) {
 		if(block.first >= size_original_ || block.first+block.second > size_original_ || available_map_.empty()) return {end(), false};
 
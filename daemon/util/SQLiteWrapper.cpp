@@ -105,7 +105,10 @@ SQLValue SQLiteResultIterator::operator[](size_t pos) const {
 }
 
 // SQLiteResult
-SQLiteResult::SQLiteResult(sqlite3_stmt* prepared_stmt) : prepared_stmt(prepared_stmt) {
+SQLiteResult::SQLiteResult(sqlite3_stmt* prepared_stmt) : SQLiteResult(prepared_stmt, 0, std::string()) {}
+
+SQLiteResult::SQLiteResult(sqlite3_stmt* prepared_stmt, SQLiteDB* cache_db, std::string cache_sql) :
+	prepared_stmt(prepared_stmt), cache_db(cache_db), cache_sql(std::move(cache_sql)) {
 	rescode = sqlite3_step(prepared_stmt);
 	shared_idx = std::make_shared<int64_t>();
 	*shared_idx = 0;
@@ -126,7 +129,10 @@ SQLiteResult::~SQLiteResult(){
 }
 
 void SQLiteResult::finalize(){
-	sqlite3_finalize(prepared_stmt);
+	if(prepared_stmt && cache_db)
+		cache_db->return_cached(cache_sql, prepared_stmt);
+	else
+		sqlite3_finalize(prepared_stmt);
 	prepared_stmt = 0;
 }
 
@@ -139,34 +145,62 @@ SQLiteResultIterator SQLiteResult::end() {
 }
 
 // SQLiteDB
-SQLiteDB::SQLiteDB(const boost::filesystem::path& db_path) {
-	open(db_path);
+SQLiteDB::SQLiteDB(const boost::filesystem::path& db_path, int flags) {
+	open(db_path, flags);
 }
 
-SQLiteDB::SQLiteDB(const char* db_path) {
-	open(db_path);
+SQLiteDB::SQLiteDB(const char* db_path, int flags) {
+	open(db_path, flags);
 }
 
 SQLiteDB::~SQLiteDB() {
 	close();
 }
 
-void SQLiteDB::open(const boost::filesystem::path& db_path) {
-	open(db_path.string().c_str());
+void SQLiteDB::open(const boost::filesystem::path& db_path, int flags) {
+	open(db_path.string().c_str(), flags);
 }
 
-void SQLiteDB::open(const char* db_path) {
-	sqlite3_open(db_path, &db);
+void SQLiteDB::open(const char* db_path, int flags) {
+	sqlite3_open_v2(db_path, &db, flags, 0);
 }
 
 void SQLiteDB::close() {
+	{
+		std::unique_lock<std::mutex> lk(stmt_cache_mtx);
+		for(auto& cached : stmt_cache)
+			sqlite3_finalize(cached.second);
+		stmt_cache.clear();
+	}
 	sqlite3_close(db);
 }
 
 SQLiteResult SQLiteDB::exec(const std::string& sql, const std::map<std::string, SQLValue>& values){
 	sqlite3_stmt* sqlite_stmt;
 	sqlite3_prepare_v2(db, sql.c_str(), (int)sql.size()+1, &sqlite_stmt, 0);
+	bind_values(sqlite_stmt, values);
+
+	return SQLiteResult(sqlite_stmt);
+}
+
+SQLiteResult SQLiteDB::exec_cached(const std::string& sql, const std::map<std::string, SQLValue>& values){
+	sqlite3_stmt* sqlite_stmt = 0;
+	{
+		std::unique_lock<std::mutex> lk(stmt_cache_mtx);
+		auto it = stmt_cache.find(sql);
+		if(it != stmt_cache.end()) {
+			sqlite_stmt = it->second;
+			stmt_cache.erase(it);	// Now it is owned by SQLiteResult. If the same query is executed while this result is alive, another statement is prepared
+		}
+	}
+	if(!sqlite_stmt)
+		sqlite3_prepare_v2(db, sql.c_str(), (int)sql.size()+1, &sqlite_stmt, 0);
+	bind_values(sqlite_stmt, values);
+
+	return SQLiteResult(sqlite_stmt, this, sql);
+}
 
+void SQLiteDB::bind_values(sqlite3_stmt* sqlite_stmt, const std::map<std::string, SQLValue>& values){
 	for(auto value : values){
 		switch(value.second.get_type()){
 		case SQLValue::ValueType::INT:
@@ -192,8 +226,15 @@ SQLiteResult SQLiteDB::exec(const std::string& sql, const std::map<std::string,
 			break;
 		}
 	}
+}
 
-	return SQLiteResult(sqlite_stmt);
+void SQLiteDB::return_cached(const std::string& sql, sqlite3_stmt* sqlite_stmt){
+	sqlite3_reset(sqlite_stmt);
+	sqlite3_clear_bindings(sqlite_stmt);
+
+	std::unique_lock<std::mutex> lk(stmt_cache_mtx);
+	if(!stmt_cache.insert({sql, sqlite_stmt}).second)
+		sqlite3_finalize(sqlite_stmt);	// Another copy is already cached
 }
 
 int64_t SQLiteDB::last_insert_rowid(){
@@ -207,10 +248,14 @@ SQLiteSavepoint::SQLiteSavepoint(SQLiteDB* db, const std::string savepoint_name)
 	db->exec(std::string("SAVEPOINT ")+name);
 }
 SQLiteSavepoint::~SQLiteSavepoint(){
+	if(committed) return;
+	// ROLLBACK TO leaves the savepoint on the stack, so it is released after that
 	db.exec(std::string("ROLLBACK TO ")+name);
+	db.exec(std::string("RELEASE ")+name);
 }
 void SQLiteSavepoint::commit() {
 	db.exec(std::string("RELEASE ")+name);
+	committed = true;
 }
 
 SQLiteLock::SQLiteLock(SQLiteDB& db) : db(db) {
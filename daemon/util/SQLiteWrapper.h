@@ -13,6 +13,7 @@
 #include <boost/filesystem/path.hpp>
 #include <memory>
 #include <map>
+#include <mutex>
 
 namespace librevault {
 
@@ -102,14 +103,20 @@ public:
 	int result_code() const {return rescode;};
 };
 
+class SQLiteDB;
 class SQLiteResult {
 	int rescode = SQLITE_OK;
 
 	sqlite3_stmt* prepared_stmt = 0;
 	std::shared_ptr<int64_t> shared_idx;
 	std::shared_ptr<std::vector<std::string>> cols;
+
+	// If set, the statement is returned to the statement cache of this DB instead of being finalized
+	SQLiteDB* cache_db = 0;
+	std::string cache_sql;
 public:
 	SQLiteResult(sqlite3_stmt* prepared_stmt);
+	SQLiteResult(sqlite3_stmt* prepared_stmt, SQLiteDB* cache_db, std::string cache_sql);
 	virtual ~SQLiteResult();
 
 	void finalize();
@@ -125,21 +132,31 @@ public:
 class SQLiteDB {
 public:
 	SQLiteDB(){};
-	SQLiteDB(const boost::filesystem::path& db_path);
-	SQLiteDB(const char* db_path);
+	SQLiteDB(const boost::filesystem::path& db_path, int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+	SQLiteDB(const char* db_path, int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
 	virtual ~SQLiteDB();
 
-	void open(const boost::filesystem::path& db_path);
-	void open(const char* db_path);
+	void open(const boost::filesystem::path& db_path, int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+	void open(const char* db_path, int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
 	void close();
 
 	sqlite3* sqlite3_handle(){return db;};
 
 	SQLiteResult exec(const std::string& sql, const std::map<std::string, SQLValue>& values = std::map<std::string, SQLValue>());
+	// Same as exec(), but the prepared statement is kept for the next call with the same sql. Use for frequent queries.
+	SQLiteResult exec_cached(const std::string& sql, const std::map<std::string, SQLValue>& values = std::map<std::string, SQLValue>());
 
 	int64_t last_insert_rowid();
 private:
+	friend class SQLiteResult;
+
 	sqlite3* db = 0;
+
+	std::mutex stmt_cache_mtx;
+	std::map<std::string, sqlite3_stmt*> stmt_cache;	// Statements, which are not in use by any SQLiteResult
+
+	void bind_values(sqlite3_stmt* sqlite_stmt, const std::map<std::string, SQLValue>& values);
+	void return_cached(const std::string& sql, sqlite3_stmt* sqlite_stmt);
 };
 
 class SQLiteSavepoint {
@@ -152,6 +169,7 @@ public:
 private:
 	SQLiteDB& db;
 	const std::string name;
+	bool committed = false;
 };
 
 class SQLiteLock {
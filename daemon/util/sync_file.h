@@ -0,0 +1,67 @@
+/* Copyright (C) 2017 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <QFile>
+#include <QString>
+#ifdef Q_OS_UNIX
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+#ifdef Q_OS_WIN
+#   include <io.h>
+#   include <windows.h>
+#endif
+
+namespace librevault {
+
+/* Flushes written data of the file to stable storage. Must be done before a file is renamed over the original, or referenced from index */
+inline bool sync_file(QFile& f) {
+	if(!f.flush()) return false;
+#if defined(Q_OS_UNIX)
+	return fsync(f.handle()) == 0;
+#elif defined(Q_OS_WIN)
+	return FlushFileBuffers((HANDLE)_get_osfhandle(f.handle())) != 0;
+#else
+	return true;
+#endif
+}
+
+/* Makes renames and removals in the directory durable. No-op, where directories can't be synced */
+inline void sync_directory(const QString& path) {
+#ifdef Q_OS_UNIX
+	int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+	if(fd < 0) return;
+	fsync(fd);
+	::close(fd);
+#else
+	Q_UNUSED(path);
+#endif
+}
+
+} /* namespace librevault */